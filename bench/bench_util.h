@@ -0,0 +1,111 @@
+// Helpers shared by the standalone benchmarks of tgc: wall clock, peak RSS
+// and pause statistics of gc_collect calls.
+
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <vector>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#include <unistd.h>
+#endif
+
+#include "tgc.h"
+
+namespace bench {
+
+using Clock = std::chrono::steady_clock;
+
+inline double elapsedMs(Clock::time_point start) {
+  return std::chrono::duration<double, std::milli>(Clock::now() - start)
+      .count();
+}
+
+// peak resident set size of the process so far, in megabytes.
+inline double peakRssMb() {
+#ifdef _WIN32
+  PROCESS_MEMORY_COUNTERS pmc;
+  GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc));
+  return pmc.PeakWorkingSetSize / 1024.0 / 1024.0;
+#else
+  rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+#ifdef __APPLE__
+  return ru.ru_maxrss / 1024.0 / 1024.0;
+#else
+  return ru.ru_maxrss / 1024.0;
+#endif
+#endif
+}
+
+// current resident set size in megabytes, the peak one where the platform
+// has no cheap way to query it.
+inline double currentRssMb() {
+#ifdef __linux__
+  long pages = 0, rss = 0;
+  if (auto* f = fopen("/proc/self/statm", "r")) {
+    if (fscanf(f, "%ld %ld", &pages, &rss) != 2)
+      rss = 0;
+    fclose(f);
+  }
+  return rss * (sysconf(_SC_PAGESIZE) / 1024.0) / 1024.0;
+#else
+  return peakRssMb();
+#endif
+}
+
+// durations of samples in microseconds, e.g. pauses or frame ticks.
+struct Durations {
+  std::vector<double> samples;
+
+  void add(double us) { samples.push_back(us); }
+  size_t count() const { return samples.size(); }
+  double total() const {
+    double r = 0;
+    for (auto i : samples)
+      r += i;
+    return r;
+  }
+  double max() const {
+    return samples.empty() ? 0
+                           : *std::max_element(samples.begin(), samples.end());
+  }
+  double percentile(double pct) {
+    if (samples.empty())
+      return 0;
+    auto n = (size_t)(pct / 100 * (samples.size() - 1));
+    std::nth_element(samples.begin(), samples.begin() + n, samples.end());
+    return samples[n];
+  }
+};
+
+// Allocation-driven collection, as tgc never collects by itself: every
+// `allocsPerCollect` calls of onAlloc run an incremental gc_collect(steps)
+// and record its pause.
+struct Pacer {
+  int allocsPerCollect;
+  int steps;
+  int allocs = 0;
+  Durations pauses;
+
+  Pacer(int allocsPerCollect = 1024, int steps = 1024 * 16)
+      : allocsPerCollect(allocsPerCollect), steps(steps) {}
+
+  void onAlloc() {
+    if (++allocs % allocsPerCollect == 0)
+      collect(steps);
+  }
+  void collect(int n) {
+    auto start = Clock::now();
+    tgc::gc_collect(n);
+    pauses.add(elapsedMs(start) * 1000);
+  }
+};
+
+}  // namespace bench
@@ -0,0 +1,217 @@
+// Runs identical workloads with tgc::gc, std::shared_ptr and raw pointers
+// with manual delete, and prints a comparison table. The time of gc includes
+// its incremental collections and the final one reclaiming the garbage.
+//
+//   tgc_compare [repeat]
+
+#include <cstdlib>
+#include <memory>
+#include <string>
+
+#include "bench_util.h"
+
+using namespace tgc;
+
+namespace {
+
+struct Raw {
+  static constexpr const char* name = "raw";
+  template <typename T>
+  using ptr = T*;
+  template <typename T, typename... Args>
+  static T* make(Args&&... args) {
+    return new T(std::forward<Args>(args)...);
+  }
+  template <typename T>
+  static void dispose(T* p) {
+    delete p;
+  }
+  static void finish() {}
+};
+
+struct Shared {
+  static constexpr const char* name = "shared_ptr";
+  template <typename T>
+  using ptr = std::shared_ptr<T>;
+  template <typename T, typename... Args>
+  static std::shared_ptr<T> make(Args&&... args) {
+    return std::make_shared<T>(std::forward<Args>(args)...);
+  }
+  template <typename T>
+  static void dispose(const std::shared_ptr<T>&) {}
+  static void finish() {}
+};
+
+struct Gc {
+  static constexpr const char* name = "gc";
+  static inline bench::Pacer pacer;
+
+  template <typename T>
+  using ptr = gc<T>;
+  template <typename T, typename... Args>
+  static gc<T> make(Args&&... args) {
+    pacer.onAlloc();
+    return gc_new<T>(std::forward<Args>(args)...);
+  }
+  template <typename T>
+  static void dispose(const gc<T>&) {}
+  // reclaim the garbage of the workload.
+  static void finish() {
+    gc_collect_full();
+  }
+};
+
+//////////////////////////////////////////////////////////////////////////
+
+template <typename P>
+void allocInts() {
+  std::vector<typename P::template ptr<int>> batch(1000);
+  long sum = 0;
+  for (int r = 0; r < 1000; r++) {
+    for (int i = 0; i < 1000; i++)
+      batch[i] = P::template make<int>(i);
+    for (auto& i : batch) {
+      sum += *i;
+      P::dispose(i);
+    }
+  }
+  if (sum != 499500000L)
+    printf("allocInts: wrong sum\n");
+}
+
+template <typename P>
+struct TreeNode {
+  typename P::template ptr<TreeNode> left, right;
+};
+
+template <typename P>
+typename P::template ptr<TreeNode<P>> makeTree(int depth) {
+  auto n = P::template make<TreeNode<P>>();
+  if (depth > 0) {
+    n->left = makeTree<P>(depth - 1);
+    n->right = makeTree<P>(depth - 1);
+  }
+  return n;
+}
+
+template <typename P>
+int checkTree(const typename P::template ptr<TreeNode<P>>& n) {
+  return n->left ? 1 + checkTree<P>(n->left) + checkTree<P>(n->right) : 1;
+}
+
+template <typename P>
+void disposeTree(const typename P::template ptr<TreeNode<P>>& n) {
+  if (n->left) {
+    disposeTree<P>(n->left);
+    disposeTree<P>(n->right);
+  }
+  P::dispose(n);
+}
+
+template <typename P>
+void binaryTrees() {
+  int sum = 0;
+  for (int i = 0; i < 32; i++) {
+    auto t = makeTree<P>(14);
+    sum += checkTree<P>(t);
+    disposeTree<P>(t);
+  }
+  if (sum != 32 * ((1 << 15) - 1))
+    printf("binaryTrees: wrong check\n");
+}
+
+template <typename P>
+struct ListNode {
+  typename P::template ptr<ListNode> next;
+  int v = 0;
+};
+
+template <typename P>
+void linkedList() {
+  for (int r = 0; r < 10; r++) {
+    typename P::template ptr<ListNode<P>> head{};
+    for (int i = 0; i < 100000; i++) {
+      auto n = P::template make<ListNode<P>>();
+      n->v = i;
+      n->next = head;
+      head = n;
+    }
+    long sum = 0;
+    for (auto n = head; n; n = n->next)
+      sum += n->v;
+    if (sum != 4999950000L)
+      printf("linkedList: wrong sum\n");
+    // unlink iteratively, the destructors of shared_ptr would recurse.
+    while (head) {
+      auto next = head->next;
+      head->next = {};
+      P::dispose(head);
+      head = next;
+    }
+  }
+}
+
+template <typename P>
+void copyChurn() {
+  auto p = P::template make<int>(1);
+  std::vector<typename P::template ptr<int>> v(1024);
+  long sum = 0;
+  for (int r = 0; r < 2000; r++) {
+    for (auto& i : v)
+      i = p;
+    for (auto& i : v)
+      sum += *i;
+  }
+  v.clear();
+  P::dispose(p);
+  if (sum != 2000L * 1024)
+    printf("copyChurn: wrong sum\n");
+}
+
+//////////////////////////////////////////////////////////////////////////
+
+template <typename P>
+double timeMs(void (*run)(), int repeat) {
+  double best = 1e30;
+  for (int i = 0; i < repeat; i++) {
+    auto start = bench::Clock::now();
+    run();
+    P::finish();
+    best = std::min(best, bench::elapsedMs(start));
+  }
+  return best;
+}
+
+struct Row {
+  const char* name;
+  void (*raw)();
+  void (*shared)();
+  void (*gc)();
+};
+
+#define TGC_COMPARE_ROW(F) {#F, F<Raw>, F<Shared>, F<Gc>}
+
+Row rows[] = {
+    TGC_COMPARE_ROW(allocInts),
+    TGC_COMPARE_ROW(binaryTrees),
+    TGC_COMPARE_ROW(linkedList),
+    TGC_COMPARE_ROW(copyChurn),
+};
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  int repeat = argc > 1 ? std::max(1, atoi(argv[1])) : 3;
+
+  printf("best of %d runs, in ms\n", repeat);
+  printf("%-12s %10s %12s %10s %10s %12s\n", "workload", Raw::name,
+         Shared::name, Gc::name, "gc/raw", "gc/shared");
+  for (auto& r : rows) {
+    auto raw = timeMs<Raw>(r.raw, repeat);
+    auto shared = timeMs<Shared>(r.shared, repeat);
+    auto gc = timeMs<Gc>(r.gc, repeat);
+    printf("%-12s %10.2f %12.2f %10.2f %10.2f %12.2f\n", r.name, raw, shared,
+           gc, gc / raw, gc / shared);
+  }
+  return 0;
+}
@@ -0,0 +1,92 @@
+// Memory a forked child copies from its parent when it collects: the parent
+// builds a large graph and as many auto-boxes, e.g. gc_int, and calls
+// gc_prepare_fork, each child runs a full collection and reports the private
+// dirty memory it gained. Built with TGC_FORK_FRIENDLY as tgc_fork_bench and
+// without it as tgc_fork_bench_base.
+//
+//   tgc_fork_bench [nodes] [children] [boxes]
+//
+// Linux only, it reads /proc/self/smaps_rollup.
+
+#include <cstdlib>
+#include <cstring>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "bench_util.h"
+
+using namespace tgc;
+
+namespace {
+
+struct Node {
+  gc<Node> next, other;
+  int payload[4] = {};
+};
+
+// private dirty memory of the process in megabytes, -1 if unknown.
+double privateDirtyMb() {
+  double kb = -1;
+  if (auto* f = fopen("/proc/self/smaps_rollup", "r")) {
+    char line[256];
+    while (fgets(line, sizeof(line), f)) {
+      if (!strncmp(line, "Private_Dirty:", 14)) {
+        kb = atof(line + 14);
+        break;
+      }
+    }
+    fclose(f);
+  }
+  return kb < 0 ? -1 : kb / 1024;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  int nodes = argc > 1 ? atoi(argv[1]) : 1000000;
+  int children = argc > 2 ? atoi(argv[2]) : 4;
+  int boxes = argc > 3 ? atoi(argv[3]) : nodes;
+
+  std::vector<gc<Node>> graph(nodes);
+  for (auto& i : graph)
+    i = gc_new<Node>();
+  unsigned seed = 1;
+  auto rand = [&] { return (seed = seed * 1103515245 + 12345) >> 8; };
+  for (int i = 0; i < nodes; i++) {
+    graph[i]->next = graph[(i + 1) % nodes];
+    graph[i]->other = graph[rand() % nodes];
+  }
+  // cells of box pages, marked in bitmaps.
+  std::vector<gc_int> values;
+  values.reserve(boxes);
+  for (int i = 0; i < boxes; i++)
+    values.push_back(i);
+  auto start = bench::Clock::now();
+  gc_prepare_fork();
+  printf("%d nodes, %d boxes, gc_prepare_fork %.1f ms, parent RSS %.1f MB\n",
+         nodes, boxes, bench::elapsedMs(start), bench::currentRssMb());
+  printf("%8s %14s %14s %10s\n", "child", "dirty before", "dirty after",
+         "gc ms");
+
+  for (int c = 0; c < children; c++) {
+    fflush(stdout);
+    auto pid = fork();
+    if (pid < 0) {
+      perror("fork");
+      return 1;
+    }
+    if (pid == 0) {
+      auto before = privateDirtyMb();
+      auto gcStart = bench::Clock::now();
+      gc_collect_full();
+      auto ms = bench::elapsedMs(gcStart);
+      printf("%8d %11.1f MB %11.1f MB %10.1f\n", c, before, privateDirtyMb(),
+             ms);
+      fflush(stdout);
+      _exit(0);
+    }
+    int status = 0;
+    waitpid(pid, &status, 0);
+  }
+  return 0;
+}
@@ -0,0 +1,162 @@
+// Latency of incremental collection under a simulated frame loop: each tick
+// allocates and rewires part of a large graph, then collects with either a
+// fixed step count, a time budget, gc_collect_auto or gc_idle_notification
+// with the rest of the frame as deadline. Reports the distribution of the tick
+// durations and of the collecting part of them, and the growth of the heap.
+//
+//   tgc_latency [--hz=60] [--ticks=600] [--nodes=200000] [--churn=2000]
+//               [--steps=N | --budget-us=N | --auto | --idle]
+//
+// Without one of the modes a few of each are compared.
+
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#include "bench_util.h"
+
+using namespace tgc;
+
+namespace {
+
+struct Node {
+  gc<Node> next, other;
+  int payload[4] = {};
+};
+
+struct Config {
+  int hz = 60;
+  int ticks = 600;
+  int nodes = 200000;
+  int churn = 2000;
+  int steps = 0;
+  int budgetUs = 0;
+  bool autoSteps = false;
+  bool idle = false;
+};
+
+// steps of one gc_collect call of the budgeted mode, small enough to check
+// the clock often.
+const int budgetSlice = 256;
+
+void run(const Config& cfg) {
+  std::vector<gc<Node>> graph(cfg.nodes);
+  for (auto& i : graph)
+    i = gc_new<Node>();
+  unsigned seed = 1;
+  auto rand = [&] { return (seed = seed * 1103515245 + 12345) >> 8; };
+  for (int i = 0; i < cfg.nodes; i++) {
+    graph[i]->next = graph[(i + 1) % cfg.nodes];
+    graph[i]->other = graph[rand() % cfg.nodes];
+  }
+  auto startRss = bench::currentRssMb();
+
+  bench::Durations ticks, gcTimes;
+  double frameUs = 1e6 / cfg.hz;
+  int overBudget = 0;
+  for (int t = 0; t < cfg.ticks; t++) {
+    auto tickStart = bench::Clock::now();
+
+    // mutator: replace nodes making garbage and rewire some edges.
+    for (int k = 0; k < cfg.churn; k++) {
+      auto i = rand() % cfg.nodes;
+      auto n = gc_new<Node>();
+      n->next = graph[i]->next;
+      n->other = graph[rand() % cfg.nodes];
+      graph[(i + cfg.nodes - 1) % cfg.nodes]->next = n;
+      graph[i] = n;
+      graph[rand() % cfg.nodes]->other = graph[rand() % cfg.nodes];
+    }
+
+    auto gcStart = bench::Clock::now();
+    if (cfg.autoSteps) {
+      gc_collect_auto();
+    } else if (cfg.idle) {
+      // the rest of the frame minus a margin for the rendering.
+      gc_idle_notification(tickStart + std::chrono::microseconds(
+                                            (long long)(frameUs * 0.9)));
+    } else if (cfg.steps) {
+      gc_collect(cfg.steps);
+    } else {
+      do {
+        gc_collect(budgetSlice);
+      } while (bench::elapsedMs(gcStart) * 1000 < cfg.budgetUs);
+    }
+    gcTimes.add(bench::elapsedMs(gcStart) * 1000);
+
+    auto us = bench::elapsedMs(tickStart) * 1000;
+    ticks.add(us);
+    if (us > frameUs)
+      overBudget++;
+  }
+
+  char mode[64];
+  if (cfg.autoSteps)
+    snprintf(mode, sizeof(mode), "auto");
+  else if (cfg.idle)
+    snprintf(mode, sizeof(mode), "idle");
+  else if (cfg.steps)
+    snprintf(mode, sizeof(mode), "steps=%d", cfg.steps);
+  else
+    snprintf(mode, sizeof(mode), "budget=%dus", cfg.budgetUs);
+  printf("%-14s %9.0f %9.0f %9.0f %9.0f %9.0f %9.0f %7d %9.1f\n", mode,
+         ticks.percentile(50), ticks.percentile(99), ticks.max(),
+         gcTimes.percentile(50), gcTimes.percentile(99), gcTimes.max(),
+         overBudget, bench::currentRssMb() - startRss);
+
+  // reclaim the graph before the next run.
+  graph.clear();
+  gc_collect_full();
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  Config cfg;
+  for (int i = 1; i < argc; i++) {
+    auto arg = [&](const char* name, int& v) {
+      auto n = strlen(name);
+      if (strncmp(argv[i], name, n) || argv[i][n] != '=')
+        return false;
+      v = atoi(argv[i] + n + 1);
+      return true;
+    };
+    if (!strcmp(argv[i], "--auto") || !strcmp(argv[i], "--idle")) {
+      (argv[i][2] == 'a' ? cfg.autoSteps : cfg.idle) = true;
+      continue;
+    }
+    if (!arg("--hz", cfg.hz) && !arg("--ticks", cfg.ticks) &&
+        !arg("--nodes", cfg.nodes) && !arg("--churn", cfg.churn) &&
+        !arg("--steps", cfg.steps) && !arg("--budget-us", cfg.budgetUs)) {
+      printf("unknown argument: %s\n", argv[i]);
+      return 1;
+    }
+  }
+
+  printf("%d Hz, %d ticks, %d nodes, %d replaced per tick, times in us\n",
+         cfg.hz, cfg.ticks, cfg.nodes, cfg.churn);
+  printf("%-14s %9s %9s %9s %9s %9s %9s %7s %9s\n", "collect", "tick p50",
+         "tick p99", "tick max", "gc p50", "gc p99", "gc max", "late",
+         "heap +MB");
+
+  if (cfg.steps || cfg.budgetUs || cfg.autoSteps || cfg.idle) {
+    run(cfg);
+    return 0;
+  }
+  for (int steps : {1024, 8192, 65536}) {
+    cfg.steps = steps;
+    run(cfg);
+  }
+  cfg.steps = 0;
+  for (int budget : {500, 2000, 8000}) {
+    cfg.budgetUs = budget;
+    run(cfg);
+  }
+  cfg.budgetUs = 0;
+  cfg.autoSteps = true;
+  run(cfg);
+  cfg.autoSteps = false;
+  cfg.idle = true;
+  run(cfg);
+  return 0;
+}
@@ -0,0 +1,253 @@
+// End-to-end workloads of tgc: Boehm's GCBench, binary-trees of the
+// benchmarks game, a large circular graph mutator and a storm of gc_function
+// callbacks. Each workload reports wall time, peak RSS and the pauses of the
+// incremental collections driven by its allocations.
+//
+//   tgc_macro [--full] [workload...]
+//
+// Without workloads all of them are run, each in its own process so the peak
+// RSS is not inherited from the previous one. --full runs GCBench and
+// binary-trees with their standard depths instead of the reduced ones.
+
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#include "bench_util.h"
+
+using namespace tgc;
+
+namespace {
+
+bool full = false;
+bench::Pacer pacer;
+
+template <typename T, typename... Args>
+gc<T> alloc(Args&&... args) {
+  pacer.onAlloc();
+  return gc_new<T>(std::forward<Args>(args)...);
+}
+
+//////////////////////////////////////////////////////////////////////////
+// GCBench
+
+struct GNode {
+  gc<GNode> left, right;
+  int i = 0, j = 0;
+  GNode() {}
+  GNode(const gc<GNode>& l, const gc<GNode>& r) : left(l), right(r) {}
+};
+
+int treeSize(int depth) {
+  return (1 << (depth + 1)) - 1;
+}
+
+void populate(int depth, const gc<GNode>& node) {
+  if (depth-- <= 0)
+    return;
+  node->left = alloc<GNode>();
+  node->right = alloc<GNode>();
+  populate(depth, node->left);
+  populate(depth, node->right);
+}
+
+gc<GNode> makeTree(int depth) {
+  if (depth <= 0)
+    return alloc<GNode>();
+  return alloc<GNode>(makeTree(depth - 1), makeTree(depth - 1));
+}
+
+void gcBench() {
+  int stretchDepth = full ? 18 : 16;
+  int longLivedDepth = full ? 16 : 14;
+  int arraySize = full ? 500000 : 125000;
+  int minDepth = 4, maxDepth = full ? 16 : 14;
+
+  makeTree(stretchDepth);
+
+  auto longLived = alloc<GNode>();
+  populate(longLivedDepth, longLived);
+  auto array = alloc<std::vector<double>>(arraySize);
+  for (int i = 0; i < arraySize / 2; i++)
+    (*array)[i] = 1.0 / i;
+
+  for (int d = minDepth; d <= maxDepth; d += 2) {
+    int iters = 2 * treeSize(stretchDepth) / treeSize(d);
+    for (int i = 0; i < iters; i++) {
+      auto t = alloc<GNode>();
+      populate(d, t);
+    }
+    for (int i = 0; i < iters; i++)
+      makeTree(d);
+  }
+
+  if (!longLived || (*array)[1000] != 1.0 / 1000)
+    printf("GCBench: long lived data is broken\n");
+}
+
+//////////////////////////////////////////////////////////////////////////
+// binary-trees
+
+struct TNode {
+  gc<TNode> left, right;
+  TNode() {}
+  TNode(const gc<TNode>& l, const gc<TNode>& r) : left(l), right(r) {}
+};
+
+gc<TNode> bottomUpTree(int depth) {
+  if (depth <= 0)
+    return alloc<TNode>();
+  return alloc<TNode>(bottomUpTree(depth - 1), bottomUpTree(depth - 1));
+}
+
+int check(const gc<TNode>& t) {
+  return t->left ? 1 + check(t->left) + check(t->right) : 1;
+}
+
+void binaryTrees() {
+  int maxDepth = full ? 21 : 16;
+  int minDepth = 4;
+
+  printf("stretch tree of depth %d\t check: %d\n", maxDepth + 1,
+         check(bottomUpTree(maxDepth + 1)));
+
+  auto longLived = bottomUpTree(maxDepth);
+  for (int d = minDepth; d <= maxDepth; d += 2) {
+    int iters = 1 << (maxDepth - d + minDepth);
+    int sum = 0;
+    for (int i = 0; i < iters; i++)
+      sum += check(bottomUpTree(d));
+    printf("%d\t trees of depth %d\t check: %d\n", iters, d, sum);
+  }
+  printf("long lived tree of depth %d\t check: %d\n", maxDepth,
+         check(longLived));
+}
+
+//////////////////////////////////////////////////////////////////////////
+// circular graph, testCirc scaled up: a ring of nodes with random cross
+// edges, part of it is replaced each round making cyclic garbage.
+
+struct CNode {
+  gc<CNode> next, other;
+};
+
+void circularGraph() {
+  const int nodeCnt = 200000, rounds = 20, replaced = nodeCnt / 4;
+
+  std::vector<gc<CNode>> nodes(nodeCnt);
+  for (auto& i : nodes)
+    i = alloc<CNode>();
+  unsigned seed = 1;
+  auto rand = [&] { return (seed = seed * 1103515245 + 12345) >> 8; };
+  for (int i = 0; i < nodeCnt; i++) {
+    nodes[i]->next = nodes[(i + 1) % nodeCnt];
+    nodes[i]->other = nodes[rand() % nodeCnt];
+  }
+
+  for (int r = 0; r < rounds; r++) {
+    for (int k = 0; k < replaced; k++) {
+      auto i = rand() % nodeCnt;
+      auto n = alloc<CNode>();
+      n->next = nodes[i]->next;
+      n->other = nodes[rand() % nodeCnt];
+      nodes[(i + nodeCnt - 1) % nodeCnt]->next = n;
+      nodes[i] = n;
+    }
+  }
+}
+
+//////////////////////////////////////////////////////////////////////////
+// gc_function storm: listeners subscribe callbacks capturing themselves and
+// a peer, all of them are fired and half of them replaced each round.
+
+struct Listener {
+  gc_function<void(int)> cb;
+  long sum = 0;
+};
+
+void functionStorm() {
+  const int listenerCnt = 50000, rounds = 40;
+
+  std::vector<gc<Listener>> listeners(listenerCnt);
+  auto subscribe = [&](int i) {
+    auto self = alloc<Listener>();
+    auto peer = listeners[(i * 7 + 1) % listenerCnt];
+    self->cb = [self, peer](int v) {
+      self->sum += v;
+      if (peer)
+        peer->sum -= v;
+    };
+    pacer.onAlloc();
+    listeners[i] = self;
+  };
+  for (int i = 0; i < listenerCnt; i++)
+    subscribe(i);
+
+  long total = 0;
+  for (int r = 0; r < rounds; r++) {
+    for (auto& i : listeners)
+      i->cb(r);
+    for (int i = r % 2; i < listenerCnt; i += 2)
+      subscribe(i);
+  }
+  for (auto& i : listeners)
+    total += i->sum;
+  printf("function storm checksum: %ld\n", total);
+}
+
+//////////////////////////////////////////////////////////////////////////
+
+struct Workload {
+  const char* name;
+  void (*run)();
+} workloads[] = {
+    {"gcbench", gcBench},
+    {"binary-trees", binaryTrees},
+    {"circular-graph", circularGraph},
+    {"function-storm", functionStorm},
+};
+
+void report(const char* name, double wallMs) {
+  printf("%-16s %10s %10s %10s %12s %12s %12s\n", "workload", "wall ms",
+         "peak MB", "pauses", "pause ms", "max us", "p99 us");
+  printf("%-16s %10.1f %10.1f %10zu %12.1f %12.1f %12.1f\n", name, wallMs,
+         bench::peakRssMb(), pacer.pauses.count(),
+         pacer.pauses.total() / 1000, pacer.pauses.max(),
+         pacer.pauses.percentile(99));
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  std::vector<const char*> names;
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "--full"))
+      full = true;
+    else
+      names.push_back(argv[i]);
+  }
+
+  if (names.empty()) {
+    int ret = 0;
+    for (auto& w : workloads) {
+      auto cmd = std::string("\"") + argv[0] + "\" " + w.name;
+      if (full)
+        cmd += " --full";
+      ret |= std::system(cmd.c_str());
+    }
+    return ret ? 1 : 0;
+  }
+
+  for (auto* name : names) {
+    auto* w = std::find_if(std::begin(workloads), std::end(workloads),
+                           [&](auto& w) { return !strcmp(w.name, name); });
+    if (w == std::end(workloads)) {
+      printf("unknown workload: %s\n", name);
+      return 1;
+    }
+    auto start = bench::Clock::now();
+    w->run();
+    report(w->name, bench::elapsedMs(start));
+  }
+  return 0;
+}
@@ -0,0 +1,193 @@
+// Microbenchmarks of the hot paths of tgc, run `tgc_bench --help` for the
+// filtering and reporting options of Google Benchmark.
+
+#include <benchmark/benchmark.h>
+
+#include "tgc.h"
+
+using namespace tgc;
+
+namespace {
+
+struct Obj {
+  int v = 0;
+  gc<Obj> next;
+};
+
+struct FromThis {
+  gc<FromThis> self;
+  FromThis() { self = gc_from(this); }
+};
+
+// garbage of the timed loops is collected with the timer paused, so the
+// allocation numbers don't include the sweeping.
+void collectGarbage(benchmark::State& state, int steps) {
+  state.PauseTiming();
+  gc_collect(steps);
+  state.ResumeTiming();
+}
+
+// collect the garbage left by a benchmark before the next one starts.
+void drain() {
+  gc_collect_full();
+}
+
+void BM_GcNewInt(benchmark::State& state) {
+  int i = 0;
+  for (auto _ : state) {
+    auto p = gc_new<int>(111);
+    benchmark::DoNotOptimize(p);
+    if (++i % 65536 == 0)
+      collectGarbage(state, 65536 * 4);
+  }
+  drain();
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_GcNewInt);
+
+void BM_GcNewObj(benchmark::State& state) {
+  int i = 0;
+  for (auto _ : state) {
+    auto p = gc_new<Obj>();
+    benchmark::DoNotOptimize(p);
+    if (++i % 65536 == 0)
+      collectGarbage(state, 65536 * 8);
+  }
+  drain();
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_GcNewObj);
+
+void BM_PtrCopy(benchmark::State& state) {
+  auto p = gc_new<int>(1);
+  for (auto _ : state) {
+    gc<int> c = p;
+    benchmark::DoNotOptimize(c);
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_PtrCopy);
+
+void BM_PtrMove(benchmark::State& state) {
+  auto p = gc_new<int>(1);
+  for (auto _ : state) {
+    gc<int> c = std::move(p);
+    p = std::move(c);
+    benchmark::DoNotOptimize(p);
+  }
+  state.SetItemsProcessed(state.iterations() * 2);
+}
+BENCHMARK(BM_PtrMove);
+
+void BM_PtrAssign(benchmark::State& state) {
+  auto a = gc_new<int>(1), b = gc_new<int>(2);
+  gc<int> c;
+  for (auto _ : state) {
+    c = a;
+    c = b;
+    benchmark::DoNotOptimize(c);
+  }
+  state.SetItemsProcessed(state.iterations() * 2);
+}
+BENCHMARK(BM_PtrAssign);
+
+void BM_MemberAssign(benchmark::State& state) {
+  auto a = gc_new<Obj>(), b = gc_new<Obj>();
+  for (auto _ : state) {
+    a->next = b;
+    a->next = nullptr;
+  }
+  state.SetItemsProcessed(state.iterations() * 2);
+}
+BENCHMARK(BM_MemberAssign);
+
+void BM_GcFrom(benchmark::State& state) {
+  int i = 0;
+  for (auto _ : state) {
+    auto p = gc_new<FromThis>();
+    benchmark::DoNotOptimize(p);
+    if (++i % 65536 == 0)
+      collectGarbage(state, 65536 * 8);
+  }
+  drain();
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_GcFrom);
+
+void BM_VectorPushBack(benchmark::State& state) {
+  auto e = gc_new<int>(1);
+  for (auto _ : state) {
+    auto v = gc_new_vector<int>();
+    for (int i = 0; i < state.range(0); i++)
+      v->push_back(e);
+    benchmark::DoNotOptimize(v);
+  }
+  drain();
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_VectorPushBack)->Arg(1000)->Arg(100000);
+
+void BM_SlotVectorPushBack(benchmark::State& state) {
+  auto e = gc_new<int>(1);
+  for (auto _ : state) {
+    auto v = gc_new_slot_vector<int>();
+    for (int i = 0; i < state.range(0); i++)
+      v->push_back(e);
+    benchmark::DoNotOptimize(v);
+  }
+  drain();
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_SlotVectorPushBack)->Arg(1000)->Arg(100000);
+
+void BM_MapInsert(benchmark::State& state) {
+  auto e = gc_new<int>(1);
+  for (auto _ : state) {
+    auto m = gc_new_map<int, int>();
+    for (int i = 0; i < state.range(0); i++)
+      m[i] = e;
+    benchmark::DoNotOptimize(m);
+  }
+  drain();
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_MapInsert)->Arg(1000)->Arg(100000);
+
+void BM_FlatHashMapInsert(benchmark::State& state) {
+  auto e = gc_new<int>(1);
+  for (auto _ : state) {
+    auto m = gc_new_flat_hash_map<int, int>();
+    for (int i = 0; i < state.range(0); i++)
+      m[i] = e;
+    benchmark::DoNotOptimize(m);
+  }
+  drain();
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_FlatHashMapInsert)->Arg(1000)->Arg(100000);
+
+// one full cycle over a heap of live linked objects plus as much garbage.
+void BM_Collect(benchmark::State& state) {
+  auto n = (int)state.range(0);
+  auto head = gc_new<Obj>();
+  auto tail = head;
+  for (int i = 1; i < n; i++)
+    tail = tail->next = gc_new<Obj>();
+  tail = nullptr;
+  gc_collect_full();
+
+  for (auto _ : state) {
+    state.PauseTiming();
+    for (int i = 0; i < n; i++)
+      gc_new<Obj>();
+    state.ResumeTiming();
+    gc_collect_full();
+  }
+  state.SetItemsProcessed(state.iterations() * n * 2);
+}
+BENCHMARK(BM_Collect)->Arg(1000)->Arg(10000)->Arg(100000)->Unit(
+    benchmark::kMillisecond);
+
+}  // namespace
+
+BENCHMARK_MAIN();
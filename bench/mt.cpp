@@ -0,0 +1,108 @@
+// Scalability of the multi-threaded version: 1..N mutator threads allocate,
+// copy and drop gc pointers while the main thread keeps collecting. Reports
+// the throughput per thread count and the contention of Collector::mutex and
+// ClassMeta::mutex. Container wrappers are left out, tracing one while another
+// thread mutates it is a race.
+//
+//   tgc_mt_bench [max threads] [ms per thread count]
+//
+// Built with TGC_MULTI_THREADED, TGC_LOCK_STATS and TGC_COUNTERS.
+
+#include <atomic>
+#include <cstdlib>
+#include <thread>
+
+#include "bench_util.h"
+
+using namespace tgc;
+
+namespace {
+
+struct Obj {
+  gc<Obj> next;
+  int v = 0;
+};
+
+std::atomic<bool> stop{false};
+
+long mutate() {
+  long ops = 0;
+  gc<Obj> ring = gc_new<Obj>();
+  ring->next = ring;
+  while (!stop) {
+    for (int i = 0; i < 64; i++) {
+      auto n = gc_new<Obj>();
+      n->next = ring->next;
+      ring->next = n;
+      gc<Obj> copy = n;
+      ring->v += copy->v;
+    }
+    ring = gc_new<Obj>();
+    ring->next = ring;
+    ops += 64;
+  }
+  return ops;
+}
+
+// wait time is summed over all threads, so it may exceed the wall time.
+void printStats(const char* name, LockStats& s, double ms) {
+  uint64_t locks = s.locks, contended = s.contended;
+  printf("  %-10s locks %10llu  contended %8llu (%6.3f%%)  wait %8.2f ms "
+         "(%6.2f%% of wall)\n",
+         name, (unsigned long long)locks, (unsigned long long)contended,
+         locks ? 100.0 * contended / locks : 0, s.waitNs / 1e6,
+         100.0 * s.waitNs / 1e6 / ms);
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  int maxThreads = argc > 1 ? atoi(argv[1])
+                            : std::max(4u, std::thread::hardware_concurrency());
+  int runMs = argc > 2 ? atoi(argv[2]) : 500;
+
+  printf("%8s %14s %14s %10s %10s\n", "threads", "ops/s", "ops/s/thread",
+         "gc max us", "gc p99 us");
+  for (int n = 1; n <= maxThreads; n *= 2) {
+    gc_collector_lock_stats().reset();
+    gc_class_lock_stats().reset();
+    gc_reset_counters();
+    stop = false;
+
+    std::vector<long> ops(n);
+    std::vector<std::thread> threads;
+    auto start = bench::Clock::now();
+    for (int i = 0; i < n; i++)
+      threads.emplace_back([&ops, i] { ops[i] = mutate(); });
+
+    bench::Pacer pacer;
+    while (bench::elapsedMs(start) < runMs)
+      pacer.collect(256);
+    stop = true;
+    for (auto& t : threads)
+      t.join();
+    auto ms = bench::elapsedMs(start);
+
+    long total = 0;
+    for (auto i : ops)
+      total += i;
+    printf("%8d %14.0f %14.0f %10.1f %10.1f\n", n, total / ms * 1000,
+           total / ms * 1000 / n, pacer.pauses.max(),
+           pacer.pauses.percentile(99));
+    printStats("collector", gc_collector_lock_stats(), ms);
+    printStats("class", gc_class_lock_stats(), ms);
+    auto c = gc_counters();
+    printf("  registry   register %llu  unregister %llu  changed %llu/%llu/%llu"
+           "  find creating %llu (scanned %llu)\n",
+           (unsigned long long)c.registerPtr,
+           (unsigned long long)c.unregisterPtr,
+           (unsigned long long)c.pointerChanged[0],
+           (unsigned long long)c.pointerChanged[1],
+           (unsigned long long)c.pointerChanged[2],
+           (unsigned long long)c.findCreatingObj,
+           (unsigned long long)c.creatingObjsScanned);
+
+    gc_collect(1 << 24);
+  }
+  return 0;
+}
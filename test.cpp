@@ -1,9 +1,13 @@
 #include "tgc.h"
 
 #include <assert.h>
-#include <chrono>
+#include <cstdio>
+#include <cstring>
 #include <iostream>
 #include <string_view>
+#ifdef TGC_MULTI_THREADED
+#include <thread>
+#endif
 
 using namespace tgc;
 using namespace std;
@@ -157,10 +161,6 @@ void testCircledContainer() {
   assert(delCnt == 1);
 }
 
-bool operator<(rc& a, rc& b) {
-  return a.a < b.a;
-}
-
 void testSet() {
   {
     gc_set<rc> t = gc_new_set<rc>();
@@ -195,6 +195,148 @@ void testDeque() {
   gc_delete(ll);
 }
 
+void testGcKey() {
+  static int delCnt = 0;
+  struct Node {
+    gc_map<gc<Node>, Node> childs = gc_new_map<gc<Node>, Node>();
+    gc_unordered_map<gc<Node>, Node> index =
+        gc_new_unordered_map<gc<Node>, Node>();
+    ~Node() { delCnt++; }
+  };
+  {
+    auto node = gc_new<Node>();
+    // keys only referenced by the maps, values referencing the owner.
+    node->childs[gc_new<Node>()] = node;
+    node->index[gc_new<Node>()] = node;
+    assert(node->index->count(node->index->begin()->first) == 1);
+    for (int i = 0; i < 3; i++)
+      gc_collect(1000);
+    assert(delCnt == 0);
+  }
+  for (int i = 0; i < 3; i++)
+    gc_collect(1000);
+  assert(delCnt == 3);
+}
+
+void testSlotVector() {
+  static int delCnt = 0;
+  struct Node {
+    gc_slot_vector<Node> childs = gc_new_slot_vector<Node>();
+    ~Node() { delCnt++; }
+  };
+
+  auto v = gc_new_slot_vector<int>();
+  for (int i = 0; i < 1000; i++) {
+    v->push_back(gc_new<int>(i));
+    // relocations in the middle of collecting must not lose elements.
+    gc_collect(3);
+  }
+  v->erase(v->begin(), v->begin() + 500);
+  gc_collect(100000);
+  assert(v->size() == 500 && *v[0] == 500 && *v[499] == 999);
+  gc<int> kept = v[0];
+  // only the container may relocate a slot, moving it out would untrace it.
+  static_assert(!std::is_move_constructible_v<std::decay_t<decltype(v[0])>>);
+  auto destroyed = gc_stats().destroyed;
+  gc_delete(v);
+  assert(v->empty() && gc_stats().destroyed == destroyed + 500);
+
+  auto d = gc_new_slot_deque<int>();
+  for (int i = 0; i < 1000; i++) {
+    d->push_front(gc_new<int>(i));
+    gc_collect(3);
+  }
+  gc_collect(100000);
+  assert(d->size() == 1000 && *d[0] == 999);
+
+  {
+    auto node = gc_new<Node>();
+    node->childs->push_back(node);
+    node->childs->push_back(gc_new<Node>());
+  }
+  gc_collect(100000);
+  gc_collect(100000);
+  assert(delCnt == 2);
+}
+
+void testFlatHashMap() {
+  static int delCnt = 0;
+  struct Node {
+    gc_flat_hash_map<int, Node> childs = gc_new_flat_hash_map<int, Node>();
+    ~Node() { delCnt++; }
+  };
+
+  auto m = gc_new_flat_hash_map<int, int>();
+  for (int i = 0; i < 1000; i++)
+    m[i * 16] = gc_new<int>(i);
+  for (int i = 0; i < 1000; i += 2)
+    assert(m->erase(i * 16) == 1);
+  gc_collect(100000);
+  assert(m->size() == 500 && !m->count(0) && m->count(16));
+  int cnt = 0;
+  for (auto& i : *m) {
+    assert(*i.second * 16 == i.first);
+    cnt++;
+  }
+  assert(cnt == 500 && *m->find(16)->second == 1);
+  gc_delete(m);
+
+  {
+    auto node = gc_new<Node>();
+    node->childs[0] = node;
+    node->childs[1] = gc_new<Node>();
+  }
+  gc_collect(1000);
+  gc_collect(1000);
+  assert(delCnt == 2);
+}
+
+void testBTreeMap() {
+  static int delCnt = 0;
+  struct Node {
+    gc_btree_map<int, Node> childs = gc_new_btree_map<int, Node>();
+    ~Node() { delCnt++; }
+  };
+
+  auto m = gc_new_btree_map<int, int>();
+  map<int, int> expected;
+  unsigned seed = 1;
+  for (int i = 0; i < 20000; i++) {
+    seed = seed * 1103515245 + 12345;
+    int k = (seed >> 8) % 3000;
+    if (i % 3 == 2) {
+      assert(m->erase(k) == expected.erase(k));
+    } else {
+      m[k] = gc_new<int>(k);
+      expected[k] = k;
+    }
+  }
+  gc_collect(100000);
+  assert(m->size() == expected.size());
+  auto e = expected.begin();
+  for (auto i : *m) {
+    assert(i.first == e->first && *i.second == e->second);
+    ++e;
+  }
+  assert(e == expected.end());
+
+  auto lo = m->lower_bound(1000), hi = m->upper_bound(2000);
+  auto elo = expected.lower_bound(1000), ehi = expected.upper_bound(2000);
+  for (; lo != hi; ++lo, ++elo)
+    assert(lo->first == elo->first);
+  assert(elo == ehi);
+  gc_delete(m);
+
+  {
+    auto node = gc_new<Node>();
+    node->childs[0] = node;
+    node->childs[1] = gc_new<Node>();
+  }
+  gc_collect(100000);
+  gc_collect(100000);
+  assert(delCnt == 2);
+}
+
 void testHashMap() {
   auto l = gc_new_unordered_map<int, int>();
   l[1] = gc_new<int>(1);
@@ -205,6 +347,68 @@ void testHashMap() {
   gc_delete(ll);
 }
 
+void testBulkClear() {
+  static int delCnt = 0;
+  struct Obj {
+    ~Obj() { delCnt++; }
+  };
+
+  auto kept = gc_new<Obj>();
+  auto v = gc_new_vector<Obj>();
+  for (int i = 0; i < 10000; i++)
+    v->push_back(i == 5000 ? kept : gc_new<Obj>());
+  // interrupt the root marking then clear in the middle of it.
+  gc_collect(1);
+  gc_clear(v);
+  assert(v->empty());
+  gc_collect(100000);
+  gc_collect(100000);
+  assert(delCnt == 9999);
+
+  auto s = gc_new_set<Obj>();
+  for (int i = 0; i < 1000; i++)
+    s->insert(gc_new<Obj>());
+  s->insert(kept);
+  gc_delete(s);
+  assert(s->empty() && delCnt == 11000);
+
+  // shared elements are destroyed once.
+  auto shared = gc_new<Obj>();
+  auto d = gc_new_vector<Obj>();
+  for (int i = 0; i < 100; i++)
+    d->push_back(i % 2 ? shared : gc_new<Obj>());
+  gc_delete(d);
+  assert(d->empty() && delCnt == 11051);
+}
+
+// clearing containers registered early doesn't hold the root marking back.
+void testClearWhileRootMarking() {
+  struct Obj {};
+
+  gc_collect_full();
+  vector<gc_vector<Obj>> vecs;
+  for (int i = 0; i < 1000; i++) {
+    vecs.push_back(gc_new_vector<Obj>());
+    for (int j = 0; j < 4; j++)
+      vecs.back()->push_back(gc_new<Obj>());
+  }
+  // registered after the elements, they are moved to where those were.
+  vector<gc<Obj>> roots(5000);
+
+  int ends = 0;
+  auto id = gc_add_event_listener([&](const GcEventInfo& e) {
+    if (e.event == GcEvent::CycleEnd)
+      ends++;
+  });
+  for (auto& v : vecs) {
+    gc_collect(64);
+    gc_clear(v);
+  }
+  gc_remove_event_listener(id);
+  assert(ends >= 1);
+  gc_collect_full();
+}
+
 void testLambda() {
   gc_function<int()> ff;
   {
@@ -218,9 +422,299 @@ void testLambda() {
   assert(i == 1);
 }
 
+void testLambdaStorage() {
+  static int delCnt = 0;
+  struct Obj {
+    gc_function<void()> cb;
+    ~Obj() { delCnt++; }
+  };
+
+  // small closure held by a root function keeps the captured object alive.
+  gc_function<int()> ff;
+  {
+    auto o = gc_new<Obj>();
+    ff = [o] { return delCnt; };
+  }
+  gc_collect(1000);
+  assert(delCnt == 0);
+  auto ff2 = ff;
+  ff = nullptr;
+  gc_collect(1000);
+  assert(delCnt == 0 && ff2() == 0);
+  ff2 = nullptr;
+  gc_collect(1000);
+  assert(delCnt == 1);
+
+  // copies share a heap closure and its state, an inline one is cloned.
+  int n = 0;
+  gc_function<int()> counter = [n]() mutable { return ++n; };
+  auto counter2 = counter;
+  assert(counter != counter2);
+  assert(counter() == 1 && counter2() == 1 && counter() == 2);
+  char big[128] = {};
+  gc_function<int()> shared = [n, big]() mutable { return ++n + big[0]; };
+  auto shared2 = shared;
+  assert(shared == shared2);
+  assert(shared() == 1 && shared2() == 2 && shared() == 3);
+
+  // closure stored in a gc object capturing its owner is still collectable.
+  {
+    auto o = gc_new<Obj>();
+    o->cb = [o] {};
+    o->cb();
+  }
+  gc_collect(1000);
+  assert(delCnt == 2);
+}
+
+void testLambdaSelfReset() {
+  struct Guard {
+    int v = 1;
+    ~Guard() { v = 0; }
+  };
+  Guard g;
+  char big[128] = {};
+  static gc_function<int()> cb;
+
+  // one-shot callbacks clearing themselves, the closure lives until it returns.
+  cb = [g] {
+    cb = nullptr;
+    return g.v;
+  };
+  assert(cb() == 1 && !cb);
+  cb = [g, big] {
+    cb = nullptr;
+    return g.v + big[0];
+  };
+  assert(cb() == 1 && !cb);
+
+  // handlers replacing themselves, a call after the switch runs the new one.
+  cb = [g] {
+    cb = [] { return 2; };
+    return g.v + cb();
+  };
+  assert(cb() == 3 && cb() == 2);
+  cb = [g, big] {
+    cb = [] { return 2; };
+    return g.v + big[0] + cb();
+  };
+  assert(cb() == 3 && cb() == 2);
+  cb = nullptr;
+}
+
+void testLambdaMove() {
+  static int copyCnt = 0, moveCnt = 0;
+  struct Counted {
+    Counted() {}
+    Counted(const Counted&) { copyCnt++; }
+    Counted(Counted&&) { moveCnt++; }
+  };
+  struct Holder {
+    gc_function<void(const Counted&, Counted)> cb;
+  };
+
+  Counted c;
+  gc_function<void(const Counted&, Counted)> f = [c](const Counted&, Counted) {};
+  copyCnt = 0;
+  f(c, Counted());
+  auto h = gc_new<Holder>();
+  h->cb = std::move(f);
+  h->cb(c, Counted());
+  assert(copyCnt == 0 && !f);
+
+  // an rvalue argument is moved once into a by value parameter of the
+  // closure, an lvalue is copied to a temporary moved in there.
+  moveCnt = 0;
+  h->cb(c, Counted());
+  assert(copyCnt == 0 && moveCnt == 1);
+  moveCnt = 0;
+  h->cb(c, c);
+  assert(copyCnt == 1 && moveCnt == 1);
+
+  auto u = std::make_unique<int>(1);
+  gc_function<int()> mo = [u = std::move(u)] { return *u; };
+  auto mo2 = mo;
+  assert(mo() == 1 && mo2 == mo);
+}
+
+void testLambdaPool() {
+  static int delCnt = 0;
+  struct Big {
+    char buf[128] = {};
+    Big() {}
+    Big(const Big&) {}
+    ~Big() { delCnt++; }
+  };
+
+  // a closure shaded by a cycle in progress is left to the sweeping.
+  gc_collect_full();
+  Big big;
+  gc_function<void()> f = [big] {};
+  delCnt = 0;
+  // released without a collection, memory is recycled by the next one.
+  f = nullptr;
+  assert(delCnt == 1);
+  f = [big] {};
+
+  // shared targets are left to the collector.
+  auto f2 = f;
+  delCnt = 0;
+  f = nullptr;
+  f2 = nullptr;
+  assert(delCnt == 0);
+  gc_collect(1000);
+  assert(delCnt == 1);
+}
+
+#ifdef __cpp_impl_coroutine
+gc_task<int> coAdd(gc<int> a, int b) {
+  co_return *a + b;
+}
+
+gc_task<int> coSum() {
+  auto a = gc_new<int>(1);
+  int r = co_await coAdd(a, 2);
+  co_return r + co_await coAdd(a, 3);
+}
+
+// awaited through a free operator co_await, ready at once.
+struct Ready {
+  int v;
+};
+
+auto operator co_await(Ready r) {
+  struct Awaiter {
+    int v;
+    bool await_ready() { return true; }
+    void await_suspend(std::coroutine_handle<>) {}
+    int await_resume() { return v; }
+  };
+  return Awaiter{r.v};
+}
+
+void testCoroutine() {
+  static int delCnt = 0;
+  struct Obj {
+    gc_task<> task;
+    ~Obj() { delCnt++; }
+  };
+
+  auto t = coSum();
+  t.start();
+  assert(t.done() && t.get() == 7);
+  Ready four{4};
+  auto ready = [](Ready r) -> gc_task<int> {
+    co_return co_await r + co_await Ready{3};
+  };
+  auto t2 = ready(four);
+  t2.start();
+  assert(t2.done() && t2.get() == 7);
+
+  // a suspended frame keeps its locals alive while the task is reachable.
+  auto suspended = []([[maybe_unused]] gc<Obj> self) -> gc_task<> {
+    auto local = gc_new<Obj>();
+    co_await std::suspend_always{};
+  };
+  {
+    auto o = gc_new<Obj>();
+    o->task = suspended(o);
+    o->task.start();
+    for (int i = 0; i < 3; i++)
+      gc_collect(1000);
+    assert(delCnt == 0);
+  }
+  // the frame referencing its owner is collected with its locals.
+  for (int i = 0; i < 3; i++)
+    gc_collect(1000);
+  assert(delCnt == 2);
+
+  // locals created after a resumption are traced as well.
+  auto resumed = []() -> gc_task<> {
+    co_await std::suspend_always{};
+    auto local = gc_new<Obj>();
+    co_await std::suspend_always{};
+  };
+  {
+    auto r = resumed();
+    r.start();
+    r.start();
+    for (int i = 0; i < 3; i++)
+      gc_collect(1000);
+    assert(delCnt == 2);
+  }
+  for (int i = 0; i < 3; i++)
+    gc_collect(1000);
+  assert(delCnt == 3);
+
+  // a local gone out of scope is not traced while the frame is suspended.
+  auto scoped = []() -> gc_task<> {
+    {
+      auto dead = gc_new<Obj>();
+    }
+    auto alive = gc_new<Obj>();
+    co_await std::suspend_always{};
+  };
+  {
+    auto r = scoped();
+    r.start();
+    for (int i = 0; i < 3; i++)
+      gc_collect(1000);
+    assert(delCnt == 4);
+  }
+  for (int i = 0; i < 3; i++)
+    gc_collect(1000);
+  assert(delCnt == 5);
+
+  // a local assigned in the middle of a cycle is shaded, the frame may be
+  // marked already while the object it was taken from is not.
+  struct Holder {
+    gc<Obj> obj;
+  };
+  auto take = [](gc<Holder> h) -> gc_task<> {
+    gc<Obj> local;
+    co_await std::suspend_always{};
+    local = h->obj;
+    h->obj = nullptr;
+    co_await std::suspend_always{};
+  };
+  for (int steps = 1; steps < 200; steps++) {
+    {
+      auto h = gc_new<Holder>();
+      h->obj = gc_new<Obj>();
+      auto r = take(h);
+      h = nullptr;
+      r.start();
+      gc_collect_full();
+      gc_collect(steps);
+      // finishes the cycle without marking again.
+      r.start();
+      gc_collect(100000);
+      assert(delCnt == 5);
+    }
+    gc_collect_full();
+    assert(delCnt == 6);
+    delCnt = 5;
+  }
+
+  // a frame failing to start is freed at once.
+  struct Throwing {
+    Throwing() = default;
+    Throwing(Throwing&&) { throw 1; }
+  };
+  auto failing = [](Throwing) -> gc_task<> { co_return; };
+  auto before = gc_stats().live();
+  try {
+    failing(Throwing());
+    assert(false);
+  } catch (int) {
+  }
+  assert(gc_stats().live() == before);
+}
+#endif
+
 void testPrimaryImplicitCtor() {
   gc<int> a(1), b = gc_new<int>(2);
-  assert(a < b);
+  assert(*a < *b);
 
   auto v = gc_new_vector<int>();
   v->push_back(1);
@@ -232,6 +726,54 @@ void testPrimaryImplicitCtor() {
   printf("%s", s->c_str());
 }
 
+void testAutoBox() {
+  // boxes share their value and are collected like any other object.
+  gc_int a = 1;
+  gc_int b = a;
+  *b += 1;
+  assert(*a == 2 && a.getMeta()->boxPage);
+
+  gc_collect_full();
+  auto before = gc_stats().live();
+  {
+    vector<gc_int> v;
+    for (int i = 0; i < 100000; i++)
+      v.push_back(i);
+    gc_string s = string("abc");
+    assert(s->size() == 3 && s.getMeta()->boxPage);
+    assert(gc_stats().live() == before + 100001);
+    // cells of a few pages, not objects of their own.
+    set<decltype(a.getMeta())> pages;
+    for (auto& i : v)
+      pages.insert(i.getMeta());
+    assert(pages.size() < 20);
+    // arrays of boxes are whole objects.
+    auto arr = gc_new_array<int>(10);
+    assert(!arr.getMeta()->boxPage);
+
+    // a deleted box is destructed once.
+    gc_string t = string("def"), t2 = t;
+    gc_delete(t);
+    gc_delete(t2);
+    assert(gc_stats().live() == before + 100002);
+    // boxes in slots are traced by their container.
+    auto slots = gc_new_slot_vector<int>();
+    for (int i = 0; i < 1000; i++) {
+      slots->push_back(gc_new<int>(i));
+      gc_collect(3);
+    }
+    gc_collect_full();
+    assert(*slots[0] == 0 && *slots[999] == 999);
+  }
+  gc_collect_full();
+  assert(gc_stats().live() == before && *a == 2);
+  // the pages are reused.
+  for (int i = 0; i < 100000; i++)
+    gc_int tmp = i;
+  gc_collect_full();
+  assert(gc_stats().live() == before);
+}
+
 void testGcFromThis() {
   struct Base {
     int i;
@@ -312,37 +854,589 @@ void testCollection() {
   }
 }
 
-const int profilingCounts = 10000 * 100;
+void testStats() {
+  struct Obj {
+    int v[4] = {};
+  };
 
-auto profiled = [](const char* tag, auto cb) {
-  auto start = std::chrono::high_resolution_clock::now();
-  for (int i = 0; i < profilingCounts; i++)
-    cb();
-  auto end = std::chrono::high_resolution_clock::now();
-  std::chrono::duration<double> elapsed_seconds = end - start;
-  printf("[%10s] elapsed time: %fs\n", tag, elapsed_seconds.count());
-};
+  gc_collect(100000);
+  auto before = gc_stats();
+  {
+    auto a = gc_new<Obj>();
+    auto b = gc_new_array<Obj>(3);
+    auto s = gc_stats();
+    assert(s.live() == before.live() + 2);
+    assert(s.liveBytes() >= before.liveBytes() + sizeof(Obj) * 4);
+
+    gc_delete(a);
+    s = gc_stats();
+    assert(s.live() == before.live() + 1);
+    assert(s.pendingFree() == before.pendingFree() + 1);
+  }
+  gc_collect(100000);
+  auto s = gc_stats();
+  assert(s.allocated == before.allocated + 2);
+  assert(s.live() == before.live() && s.liveBytes() == before.liveBytes());
+  assert(s.pendingFree() == 0);
+}
+
+void testEvents() {
+  static bool inDtor = false;
+  int starts = 0, ends = 0, phases = 0, crossings = 0;
+  uint64_t crossed = 0, started = 0;
+  auto id = gc_add_event_listener([&](const GcEventInfo& e) {
+    switch (e.event) {
+      case GcEvent::CycleStart:
+        started = e.cycle;
+        starts++;
+        break;
+      case GcEvent::CycleEnd:
+        // the first one may end a cycle started before adding the listener.
+        assert(e.state == GcState::RootMarking);
+        assert(!starts || e.cycle == started);
+        ends++;
+        break;
+      case GcEvent::PhaseChange:
+        phases++;
+        break;
+      case GcEvent::HeapThreshold:
+        assert(e.stats.liveBytes() >= e.threshold && !inDtor);
+        crossed = e.threshold;
+        crossings++;
+        // listeners run unlocked, so they may allocate.
+        gc_new<int>(1);
+        break;
+    }
+  });
+
+  gc_collect(100000);
+  assert(starts >= 1 && ends >= 1 && phases >= ends * 3);
+
+  auto threshold = gc_stats().liveBytes() + 1000;
+  gc_set_heap_thresholds({threshold});
+  {
+    vector<gc<int>> v;
+    for (int i = 0; i < 10; i++)
+      v.push_back(gc_new_array<int>(100));
+    assert(crossings == 1 && crossed == threshold);
+  }
+  // rearmed once a cycle ends below it.
+  gc_collect(100000);
+  {
+    vector<gc<int>> v;
+    for (int i = 0; i < 10; i++)
+      v.push_back(gc_new_array<int>(100));
+    assert(crossings == 2);
+  }
+
+  // crossed by a destructor the sweeper runs, notified once the collection
+  // unlocks.
+  struct Allocating {
+    ~Allocating() {
+      inDtor = true;
+      for (int i = 0; i < 10; i++)
+        gc_new_array<int>(1000);
+      inDtor = false;
+    }
+  };
+  gc_collect(100000);
+  gc_new<Allocating>();
+  gc_collect(100000);
+  assert(crossings == 3);
+
+  gc_remove_event_listener(id);
+  gc_set_heap_thresholds({});
+  auto n = starts;
+  gc_collect(100000);
+  assert(starts == n);
+}
+
+void testIdle() {
+  using Clock = std::chrono::steady_clock;
+
+  gc_collect(100000);
+  auto before = gc_stats();
+  for (int i = 0; i < 1000; i++)
+    gc_new<int>(i);
+  assert(!gc_idle_notification(Clock::now() - std::chrono::seconds(1)));
+
+  // the first cycle may have started before the garbage was made.
+  int cycles = 0;
+  for (int i = 0; i < 100000 && cycles < 2; i++)
+    if (gc_idle_notification(Clock::now() + std::chrono::microseconds(200)))
+      cycles++;
+  assert(cycles == 2 && gc_stats().live() == before.live());
+}
+
+void testCollectAuto() {
+  struct Node {
+    gc<Node> next;
+  };
+
+  int cycles = 0;
+  auto id = gc_add_event_listener([&](const GcEventInfo& e) {
+    if (e.event == GcEvent::CycleEnd)
+      cycles++;
+  });
+  auto before = gc_stats();
+  gc_collect_auto();
+  {
+    // half of the allocations are kept.
+    gc<Node> head;
+    for (int i = 0; i < 200000; i++) {
+      auto n = gc_new<Node>();
+      if (i % 2) {
+        n->next = head;
+        head = n;
+      }
+      if (i % 100 == 0)
+        gc_collect_auto();
+    }
+    auto p = gc_pacer_stats();
+    assert(p.cycleWork > 0 && p.stepsPerAlloc > 0 && p.lastSteps >= 64);
+    // a call every 100 allocations, and both phases learned.
+    assert(p.allocsPerCall > 50 && p.allocsPerCall < 200);
+    assert(p.markStepsPerObject > 0 && p.sweepStepsPerObject > 0);
+    // cycles keep up with the growing heap, the garbage is at most as much
+    // as the heap was when a cycle started.
+    assert(cycles >= 5);
+    assert(gc_stats().live() - before.live() < 100000 * 3);
+  }
+  gc_remove_event_listener(id);
+  // don't leave a cycle half-finished to the next tests.
+  gc_collect_full();
+}
+
+#ifdef TGC_MULTI_THREADED
+// cycles complete while an object stays under construction.
+void testCollectWhileCreating() {
+  struct Node {
+    gc<Node> next;
+    int v = 0;
+  };
+  struct Builder {
+    gc<Node> child = gc_new<Node>();
+    int ends = 0;
+    Builder() {
+      child->v = 7;
+      auto id = gc_add_event_listener([this](const GcEventInfo& e) {
+        if (e.event == GcEvent::CycleEnd)
+          ends++;
+      });
+      for (int i = 0; i < 100; i++) {
+        auto g = gc_new<Node>();
+        g->next = g;
+        gc_collect(1000);
+      }
+      gc_remove_event_listener(id);
+      assert(ends > 1 && child->v == 7);
+    }
+  };
+  auto b = gc_new<Builder>();
+  gc_collect_full();
+  assert(b->child->v == 7);
+}
+#endif
+
+void testCollectFull() {
+  struct Node {
+    gc<Node> next;
+    gc_vector<Node> children;
+    int v = 0;
+  };
+  // collects while its fields are under construction.
+  struct Builder {
+    gc<Node> child = gc_new<Node>();
+    Builder() {
+      child->v = 7;
+      gc_collect_full();
+    }
+  };
+
+  gc_collect_full();
+  auto before = gc_stats();
+  int starts = 0, ends = 0;
+  auto id = gc_add_event_listener([&](const GcEventInfo& e) {
+    if (e.event == GcEvent::CycleStart)
+      starts++;
+    if (e.event == GcEvent::CycleEnd)
+      ends++;
+  });
+  {
+    auto root = gc_new<Node>();
+    root->children = gc_new_vector<Node>();
+    for (int i = 0; i < 100; i++) {
+      auto n = gc_new<Node>();
+      n->v = i;
+      n->next = n;
+      root->children->push_back(n);
+      // cyclic garbage
+      auto g = gc_new<Node>();
+      g->next = gc_new<Node>();
+      g->next->next = g;
+    }
+    // drops the incremental cycle in progress.
+    gc_collect(50);
+    gc_collect_full();
+    assert(starts == 1 && ends == 1);
+    assert(gc_stats().live() == before.live() + 102);
+    for (int i = 0; i < 100; i++)
+      assert((*root->children)[i]->next->v == i);
+
+    auto b = gc_new<Builder>();
+    assert(b->child->v == 7);
+    gc_collect_full();
+    assert(b->child->v == 7);
+  }
+  gc_collect_full();
+  assert(gc_stats().live() == before.live() && starts == ends);
+  gc_remove_event_listener(id);
+}
+
+#ifdef TGC_MULTI_THREADED
+// large heaps are traced by several threads once enabled.
+void testParallelMark() {
+  struct Node {
+    gc<Node> next;
+    gc_int v;
+  };
+
+  gc_collect_full();
+  auto before = gc_stats().live();
+  gc_set_mark_threads(4);
+  {
+    auto roots = gc_new_vector<Node>();
+    for (int i = 0; i < 200; i++) {
+      gc<Node> head;
+      for (int j = 0; j < 500; j++) {
+        auto n = gc_new<Node>();
+        n->v = j;
+        n->next = head;
+        head = n;
+      }
+      roots->push_back(head);
+      // cyclic garbage
+      auto g = gc_new<Node>();
+      g->next = gc_new<Node>();
+      g->next->next = g;
+    }
+    gc_collect_full();
+    // the nodes, their boxes and the vector.
+    assert(gc_stats().live() == before + 200 * 500 * 2 + 1);
+    for (int i = 0; i < 200; i++) {
+      int len = 0, sum = 0;
+      for (gc<Node> n = roots[i]; n; n = n->next, len++)
+        sum += *n->v;
+      assert(len == 500 && sum == 499 * 500 / 2);
+    }
+  }
+  gc_collect_full();
+  assert(gc_stats().live() == before);
+  gc_set_mark_threads(1);
+}
+
+void testLambdaCopyThreads() {
+  // copies only read the source, so threads may copy and call one function.
+  auto v = gc_new<int>(1);
+  char big[128] = {};
+  const gc_function<int()> small = [v] { return *v; };
+  const gc_function<int()> large = [v, big] { return *v + big[0]; };
+
+  vector<std::thread> threads;
+  for (int t = 0; t < 4; t++) {
+    threads.emplace_back([&] {
+      for (int i = 0; i < 2000; i++) {
+        gc_function<int()> f = small, g = large;
+        assert(f() == 1 && small() == 1 && g() == 1 && large() == 1);
+        assert(g == large);
+        if (i % 100 == 0)
+          gc_collect(100);
+      }
+    });
+  }
+  for (auto& t : threads)
+    t.join();
+  assert(small() == 1 && large() == 1);
+}
+#endif
+
+void testPrepareFork() {
+  struct Node {
+    gc<Node> next;
+    int v = 0;
+  };
+
+  gc_collect_full();
+  auto before = gc_stats();
+  {
+    gc<Node> head;
+    vector<gc_int> boxes;
+    for (int i = 0; i < 1000; i++) {
+      auto n = gc_new<Node>();
+      n->v = i;
+      gc_int b = i;
+      if (i % 2) {
+        n->next = head;
+        head = n;
+        boxes.push_back(b);
+      }
+    }
+    gc_prepare_fork();
+    assert(gc_stats().live() == before.live() + 1000);
+
+    // the objects allocated after it are collected as before, boxes too.
+    for (int i = 0; i < 1000; i++) {
+      gc_new<Node>()->next = head;
+      gc_int b = i;
+    }
+    gc_collect_full();
+    int sum = 0, boxSum = 0;
+    for (auto n = head; n; n = n->next)
+      sum += n->v;
+    for (auto& b : boxes)
+      boxSum += *b;
+    assert(sum == 500 * 500 && boxSum == 500 * 500);
+    assert(gc_stats().live() == before.live() + 1000);
+  }
+  gc_collect_full();
+  assert(gc_stats().live() == before.live());
+}
+
+void testPermanent() {
+  struct Node {
+    gc<Node> next;
+    gc_vector<Node> children;
+    gc_slot_vector<Node> slots;
+    int v = 0;
+  };
+
+  gc_collect_full();
+  auto before = gc_stats();
+  Node* config = nullptr;
+  {
+    auto root = gc_new<Node>();
+    root->children = gc_new_vector<Node>();
+    root->slots = gc_new_slot_vector<Node>();
+    for (int i = 0; i < 10; i++) {
+      auto n = gc_new<Node>();
+      n->v = i;
+      root->children->push_back(n);
+    }
+    root->next = root;
+    gc_make_permanent(root);
+    config = root.operator->();
+  }
+  // root, its two containers and the children.
+  gc_collect_full();
+  auto s = gc_stats();
+  assert(s.permanent == before.permanent + 13);
+  assert(s.live() == before.live() + 13);
+  assert(config->children->size() == 10 && (*config->children)[9]->v == 9);
+
+  // pointers from permanent objects keep the rest of the heap alive.
+  config->next = gc_new<Node>();
+  config->next->v = 100;
+  config->children->push_back(gc_new<Node>());
+  config->children->back()->v = 101;
+  config->slots->push_back(gc_new<Node>());
+  (*config->slots)[0]->v = 102;
+  gc_collect(100);
+  gc_collect_full();
+  assert(config->next->v == 100 && config->children->back()->v == 101);
+  assert((*config->slots)[0]->v == 102);
+  assert(gc_stats().live() == before.live() + 16);
+  config->next = nullptr;
+  config->slots->pop_back();
+  gc_collect_full();
+  assert(gc_stats().live() == before.live() + 14);
+
+  // the temporaries of the scope are collected, the kept objects not.
+  gc<Node> kept;
+  {
+    gc_permanent_scope scope;
+    kept = gc_new<Node>();
+    for (int i = 0; i < 100; i++) {
+      auto tmp = gc_new<Node>();
+      tmp->next = kept;
+      if (i % 10 == 0)
+        kept->next = tmp;
+    }
+    kept->next->v = 7;
+  }
+  s = gc_stats();
+  assert(s.permanent == before.permanent + 15);
+  kept = nullptr;
+  gc_collect_full();
+  assert(gc_stats().live() == s.live());
+
+#ifdef TGC_MULTI_THREADED
+  // only the allocations of the thread of the scope are made permanent.
+  gc<Node> other;
+  {
+    gc_permanent_scope scope;
+    kept = gc_new<Node>();
+    std::thread([&] { other = gc_new<Node>(); }).join();
+    gc_permanent_scope nested;
+  }
+  assert(gc_stats().permanent == s.permanent + 1);
+  other = nullptr;
+  gc_collect_full();
+  assert(gc_stats().live() == s.live() + 1);
+  s = gc_stats();
+#endif
+
+  // the remembered slot containers are traced over several steps.
+  vector<gc_slot_vector<Node>> remembered;
+  for (int i = 0; i < 100; i++) {
+    remembered.push_back(gc_new_slot_vector<Node>());
+    gc_make_permanent(remembered.back());
+  }
+  for (int cycle = 0; cycle < 3; cycle++) {
+    for (auto& i : remembered) {
+      i->clear();
+      i->push_back(gc_new<Node>());
+      (*i)[0]->v = cycle;
+    }
+    int ends = 0;
+    auto id = gc_add_event_listener([&](const GcEventInfo& e) {
+      if (e.event == GcEvent::CycleEnd)
+        ends++;
+    });
+    while (ends < 2)
+      gc_collect(3);
+    gc_remove_event_listener(id);
+    for (auto& i : remembered)
+      assert((*i)[0]->v == cycle);
+  }
+  remembered.clear();
+  gc_collect_full();
+  assert(gc_stats().live() == s.live() + 200);
+}
+
+#ifdef TGC_COUNTERS
+void testCounters() {
+  struct Obj {
+    int v = 0;
+  };
 
-void profileAlloc() {
-#ifndef _DEBUG
-  vector<int*> rawPtrs;
-  rawPtrs.reserve(profilingCounts);
-  profiled("gc int", [] { gc<int> p(111); });
-  profiled("raw int", [&] { rawPtrs.push_back(new int(111)); });
-  for (auto* i : rawPtrs)
-    delete i;
-  gc_collect(profilingCounts * 2);
+  gc_reset_counters();
+  {
+    auto a = gc_new<Obj>();
+    gc<Obj> b = a;
+    b = a;
+  }
+  auto c = gc_counters();
+  assert(c.registerPtr == 2 && c.unregisterPtr == 2);
+  assert(c.pointerChanged[0] + c.pointerChanged[1] + c.pointerChanged[2] >= 2);
+}
 #endif
+
+#ifdef TGC_AGE_STATS
+void testAgeStats() {
+  struct Aged {
+    int v = 0;
+  };
+  auto find = [] {
+    for (auto& i : gc_age_stats())
+      if (!strcmp(i.className, typeid(Aged).name()))
+        return i;
+    return GcAgeHistogram{};
+  };
+
+  auto kept = gc_new<Aged>();
+  for (int i = 0; i < 3; i++)
+    gc_new<Aged>();
+
+  // kept gets one cycle older each cycle, so the histograms of consecutive
+  // cycles differ.
+  GcAgeHistogram last;
+  uint64_t died = 0;
+  int cycles = 0, oldest = -1;
+  for (int i = 0; i < 1000000 && cycles < 4; i++) {
+    gc_collect(1);
+    auto h = find();
+    if (!memcmp(&h, &last, sizeof(h)))
+      continue;
+    last = h;
+    cycles++;
+    uint64_t survived = 0;
+    for (int a = 0; a <= GcAgeHistogram::MaxAge; a++) {
+      died += h.died[a];
+      survived += h.survived[a];
+      if (h.survived[a])
+        oldest = a;
+    }
+    assert(survived <= 1);
+  }
+  assert(cycles == 4 && died == 3 && oldest >= 2);
 }
+#endif
+
+#ifdef TGC_HEAP_PROFILER
+void testHeapProfiler() {
+  struct Obj {
+    char payload[100];
+  };
+  auto path = "tgc_heap_profile.txt";
+  auto readHeader = [&](unsigned long long* h) {
+    auto* f = fopen(path, "r");
+    assert(f);
+    auto n = fscanf(f, "heap profile: %llu: %llu [%llu: %llu]", h, h + 1,
+                    h + 2, h + 3);
+    fclose(f);
+    assert(n == 4);
+  };
+
+  // sample every allocation.
+  gc_heap_profiler_start(1);
+  {
+    vector<gc<Obj>> objs;
+    for (int i = 0; i < 100; i++)
+      objs.push_back(gc_new<Obj>());
+    gc_heap_profiler_stop();
+    gc_new<Obj>();
+
+    unsigned long long h[4];
+    assert(gc_heap_profiler_dump(path));
+    readHeader(h);
+    assert(h[0] == 100 && h[2] == 100 && h[1] == h[3] && h[1] >= 100 * 100);
+  }
+  gc_collect(10000);
+
+  unsigned long long h[4];
+  assert(gc_heap_profiler_dump(path));
+  readHeader(h);
+  assert(h[0] == 0 && h[1] == 0 && h[2] == 100);
+
+  // boxes are sampled one by one, by the size of their cells.
+  gc_heap_profiler_start(1);
+  {
+    vector<gc_int> boxes;
+    for (int i = 0; i < 100; i++)
+      boxes.push_back(i);
+    gc_heap_profiler_stop();
+
+    assert(gc_heap_profiler_dump(path));
+    readHeader(h);
+    auto cell = max(sizeof(int), sizeof(void*));
+    assert(h[0] == 100 && h[1] == 100 * cell && h[2] == 100 && h[3] == h[1]);
+  }
+  gc_collect_full();
+  assert(gc_heap_profiler_dump(path));
+  readHeader(h);
+  assert(h[0] == 0 && h[1] == 0 && h[2] == 100);
+  remove(path);
+}
+#endif
 
 int main() {
-  profileAlloc();
   testCollection();
   testException();
   testDynamicCast();
   testGcFromThis();
   testCircledContainer();
   testPrimaryImplicitCtor();
+  testAutoBox();
   testSet();
   testEmpty();
   testPointerCast();
@@ -352,7 +1446,41 @@ int main() {
   testList();
   testDeque();
   testHashMap();
+  testBulkClear();
+  testClearWhileRootMarking();
+  testGcKey();
+  testSlotVector();
+  testFlatHashMap();
+  testBTreeMap();
   testLambda();
+  testLambdaStorage();
+  testLambdaSelfReset();
+  testLambdaMove();
+  testLambdaPool();
+#ifdef __cpp_impl_coroutine
+  testCoroutine();
+#endif
+  testStats();
+  testEvents();
+  testIdle();
+  testCollectAuto();
+  testCollectFull();
+#ifdef TGC_MULTI_THREADED
+  testCollectWhileCreating();
+  testParallelMark();
+  testLambdaCopyThreads();
+#endif
+  testPrepareFork();
+  testPermanent();
+#ifdef TGC_COUNTERS
+  testCounters();
+#endif
+#ifdef TGC_AGE_STATS
+  testAgeStats();
+#endif
+#ifdef TGC_HEAP_PROFILER
+  testHeapProfiler();
+#endif
 
   // there are some objects leaked from the upper tests, just dump them
   // out.
@@ -1,25 +1,365 @@
 #include "tgc.h"
 
+#include <atomic>
+#include <climits>
+#include <cstring>
+#include <new>
+
 #ifdef _WIN32
 #include <crtdbg.h>
 #endif
 
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+#ifdef TGC_MULTI_THREADED
+#include <condition_variable>
+#include <thread>
+#endif
+
+#ifdef TGC_HEAP_PROFILER
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <mutex>
+#include <random>
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#elif __has_include(<execinfo.h>)
+#include <execinfo.h>
+#define TGC_HAS_EXECINFO
+#endif
+#endif
+
 namespace tgc {
 namespace details {
 
 #ifndef TGC_MULTI_THREADED
-shared_mutex ClassMeta::mutex;
+ClassMutex ClassMeta::mutex;
 #endif
 atomic<int> ClassMeta::isCreatingObj = 0;
 ClassMeta ClassMeta::dummy;
 char* ObjMeta::dummyObjPtr = nullptr;
 Collector* Collector::inst = nullptr;
 
+namespace {
+// see GcStats.
+struct HeapTotals {
+  atomic<uint64_t> allocated = 0, allocatedBytes = 0;
+  atomic<uint64_t> destroyed = 0, destroyedBytes = 0;
+  atomic<uint64_t> freed = 0;
+  atomic<uint64_t> permanent = 0;
+} heapTotals;
+
+size_t heapBytes(ObjMeta* meta) {
+  return meta->klass->size * meta->arrayLength + sizeof(ObjMeta);
+}
+
+uint64_t liveBytes() {
+  uint64_t destroyed = heapTotals.destroyedBytes;
+  return heapTotals.allocatedBytes - destroyed;
+}
+
+// the objects the collector deals with, boxes included and pages not.
+uint64_t heapObjs() {
+  uint64_t freed = heapTotals.freed, permanent = heapTotals.permanent;
+  return heapTotals.allocated - freed - permanent;
+}
+
+#ifdef TGC_FORK_FRIENDLY
+// What a cycle writes for each object, by ObjMeta::SideColor::slot.
+struct MarkSlot {
+  ObjMeta::Color color = ObjMeta::Color::White;
+#ifdef TGC_AGE_STATS
+  unsigned char age = 0;
+#endif
+};
+
+// Chunks of slots allocated as needed which never move, so the table never
+// has to be copied as it grows. Used with the lock of the collector held.
+class MarkTable {
+ public:
+  static constexpr unsigned ChunkBits = 16, ChunkSize = 1u << ChunkBits;
+  static constexpr unsigned MaxChunks = 1u << 15;
+
+  ~MarkTable() {
+    for (auto* i : chunks)
+      delete[] i;
+    for (auto* i : boxBits)
+      delete[] i;
+  }
+  MarkSlot& operator[](unsigned slot) {
+    return chunks[slot >> ChunkBits][slot & (ChunkSize - 1)];
+  }
+  unsigned alloc() {
+    if (freeSlots.size()) {
+      auto slot = freeSlots.back();
+      freeSlots.pop_back();
+      (*this)[slot] = MarkSlot{};
+      return slot;
+    }
+    // newMeta frees the object being allocated.
+    if (used == ChunkSize * MaxChunks)
+      throw std::bad_alloc();
+    auto& chunk = chunks[used >> ChunkBits];
+    if (!chunk)
+      chunk = new MarkSlot[ChunkSize];
+    return used++;
+  }
+  void free(unsigned slot) { freeSlots.push_back(slot); }
+
+  // The mark bits of the cells of a box page, kept here as well so that
+  // marking boxes and clearing their marks don't write to their pages.
+  static constexpr size_t BoxBitsWords =
+      BoxSlab::PageSize / sizeof(void*) / 64;
+  uint64_t* allocBoxBits() {
+    if (spareBoxBits.size()) {
+      auto* bits = spareBoxBits.back();
+      spareBoxBits.pop_back();
+      memset(bits, 0, BoxBitsWords * sizeof(uint64_t));
+      return bits;
+    }
+    boxBits.push_back(new uint64_t[BoxBitsWords]());
+    return boxBits.back();
+  }
+  void freeBoxBits(uint64_t* bits) { spareBoxBits.push_back(bits); }
+
+ private:
+  MarkSlot* chunks[MaxChunks] = {};
+  unsigned used = 0;
+  vector<unsigned> freeSlots;
+  vector<uint64_t*> boxBits, spareBoxBits;
+};
+
+MarkTable* marks = new MarkTable();
+#endif
+
+struct EventHub {
+  shared_mutex mutex;
+  vector<pair<int, GcEventListener>> listeners;
+  int nextId = 0;
+  // ascending, the first `crossed` ones are above the live bytes.
+  vector<uint64_t> thresholds;
+  size_t crossed = 0;
+
+  // never freed, the collector may still collect at exit.
+  static EventHub& get() {
+    static auto* inst = new EventHub();
+    return *inst;
+  }
+  void updateNextThreshold();
+  void notify(const vector<GcEventInfo>& events);
+};
+
+// checked without locking by collections and allocations.
+std::atomic<bool> hasEventListeners{false};
+std::atomic<uint64_t> nextHeapThreshold{UINT64_MAX};
+
+void EventHub::updateNextThreshold() {
+  nextHeapThreshold =
+      crossed < thresholds.size() ? thresholds[crossed] : UINT64_MAX;
+}
+
+void EventHub::notify(const vector<GcEventInfo>& events) {
+  // copied so listeners may add or remove listeners.
+  vector<GcEventListener> ls;
+  {
+    shared_lock lk{mutex};
+    for (auto& i : listeners)
+      ls.push_back(i.second);
+  }
+  for (auto& e : events)
+    for (auto& l : ls)
+      l(e);
+}
+}  // namespace
+
+//////////////////////////////////////////////////////////////////////////
+
+#ifdef TGC_HEAP_PROFILER
+
+namespace {
+
+// allocations sampled at one call stack.
+struct HeapSite {
+  uint64_t allocObjs = 0, allocBytes = 0;
+  uint64_t liveObjs = 0, liveBytes = 0;
+};
+
+struct HeapSamples {
+  std::mutex mutex;
+  size_t meanBytes = 0;
+  map<vector<void*>, HeapSite> sites;
+  // sampled objects not freed yet, by meta or, for boxes, by cell.
+  unordered_map<const void*, pair<HeapSite*, size_t>> live;
+};
+
+// never freed, sampled objects may be freed by the collector at exit.
+HeapSamples& heapSamples() {
+  static auto* inst = new HeapSamples();
+  return *inst;
+}
+
+// 0 while stopped, checked by every allocation.
+std::atomic<size_t> sampleMeanBytes{0};
+// bumped by gc_heap_profiler_start so threads draw a new interval.
+std::atomic<unsigned> samplerEpoch{0};
+
+struct ThreadSampler {
+  int64_t bytesLeft = 0;
+  unsigned epoch = 0;
+  std::mt19937_64 rng{
+      (uint64_t)(uintptr_t)this ^
+      (uint64_t)std::chrono::steady_clock::now().time_since_epoch().count()};
+
+  int64_t nextInterval(size_t mean) {
+    std::exponential_distribution<double> d(1.0 / (double)mean);
+    return (int64_t)d(rng) + 1;
+  }
+};
+thread_local ThreadSampler threadSampler;
+
+const int MaxStackDepth = 64;
+
+#ifdef _MSC_VER
+__declspec(noinline)
+#else
+__attribute__((noinline))
+#endif
+void sampleAlloc(const void* obj, size_t bytes) {
+  void* frames[MaxStackDepth + 1];
+#ifdef _WIN32
+  int n = CaptureStackBackTrace(0, MaxStackDepth + 1, frames, nullptr);
+#elif defined(TGC_HAS_EXECINFO)
+  int n = backtrace(frames, MaxStackDepth + 1);
+#else
+  int n = 0;
+#endif
+  // skip the frame of sampleAlloc itself.
+  vector<void*> stack(frames + (n ? 1 : 0), frames + n);
+
+  auto& s = heapSamples();
+  std::lock_guard<std::mutex> lk{s.mutex};
+  auto* site = &s.sites[stack];
+  site->allocObjs++;
+  site->allocBytes += bytes;
+  site->liveObjs++;
+  site->liveBytes += bytes;
+  s.live[obj] = {site, bytes};
+}
+
+// the Poisson process of tcmalloc: a sample is taken when the bytes
+// allocated by this thread exceed an exponentially distributed interval.
+// The caller flags the sampled object to look it up when freed.
+inline bool maybeSampleAlloc(const void* obj, size_t bytes, size_t mean) {
+  auto& t = threadSampler;
+  auto epoch = samplerEpoch.load(std::memory_order_relaxed);
+  if (t.epoch != epoch) {
+    t.epoch = epoch;
+    t.bytesLeft = t.nextInterval(mean);
+  }
+  if ((t.bytesLeft -= (int64_t)bytes) > 0)
+    return false;
+  t.bytesLeft = t.nextInterval(mean);
+  sampleAlloc(obj, bytes);
+  return true;
+}
+
+void onSampledFree(const void* obj) {
+  auto& s = heapSamples();
+  std::lock_guard<std::mutex> lk{s.mutex};
+  auto it = s.live.find(obj);
+  if (it == s.live.end())
+    return;
+  it->second.first->liveObjs--;
+  it->second.first->liveBytes -= it->second.second;
+  s.live.erase(it);
+}
+
+}  // namespace
+
+void gc_heap_profiler_start(size_t meanBytes) {
+  auto& s = heapSamples();
+  std::lock_guard<std::mutex> lk{s.mutex};
+  s.sites.clear();
+  s.live.clear();
+  s.meanBytes = max<size_t>(meanBytes, 1);
+  samplerEpoch++;
+  sampleMeanBytes = s.meanBytes;
+}
+
+void gc_heap_profiler_stop() {
+  sampleMeanBytes = 0;
+}
+
+bool gc_heap_profiler_dump(const char* path) {
+  auto* f = fopen(path, "w");
+  if (!f)
+    return false;
+
+  auto& s = heapSamples();
+  {
+    std::lock_guard<std::mutex> lk{s.mutex};
+    HeapSite total;
+    for (auto& i : s.sites) {
+      total.allocObjs += i.second.allocObjs;
+      total.allocBytes += i.second.allocBytes;
+      total.liveObjs += i.second.liveObjs;
+      total.liveBytes += i.second.liveBytes;
+    }
+    auto print = [&](const HeapSite& h) {
+      fprintf(f, "%llu: %llu [%llu: %llu] @", (unsigned long long)h.liveObjs,
+              (unsigned long long)h.liveBytes, (unsigned long long)h.allocObjs,
+              (unsigned long long)h.allocBytes);
+    };
+    fprintf(f, "heap profile: ");
+    print(total);
+    fprintf(f, " heap_v2/%llu\n", (unsigned long long)s.meanBytes);
+    for (auto& i : s.sites) {
+      print(i.second);
+      for (auto* pc : i.first)
+        fprintf(f, " 0x%llx", (unsigned long long)(uintptr_t)pc);
+      fprintf(f, "\n");
+    }
+  }
+
+#ifdef __linux__
+  // lets pprof map the addresses to the binaries.
+  if (auto* maps = fopen("/proc/self/maps", "r")) {
+    fprintf(f, "\nMAPPED_LIBRARIES:\n");
+    char buf[4096];
+    while (auto n = fread(buf, 1, sizeof(buf), maps))
+      fwrite(buf, 1, n, f);
+    fclose(maps);
+  }
+#endif
+
+  bool ok = !ferror(f);
+  return fclose(f) == 0 && ok;
+}
+
+#endif
+
 static const char* StateStr[(int)Collector::State::MaxCnt] = {
     "RootMarking", "LeafMarking", "Sweeping"};
 
 //////////////////////////////////////////////////////////////////////////
 
+#ifdef TGC_FORK_FRIENDLY
+inline ObjMeta::SideColor& ObjMeta::SideColor::operator=(Color c) {
+  (*marks)[slot].color = c;
+  return *this;
+}
+
+inline ObjMeta::SideColor::operator Color() const {
+  return (*marks)[slot].color;
+}
+#endif
+
 char* ObjMeta::objPtr() const {
   return klass == &ClassMeta::dummy ? dummyObjPtr
                                     : (char*)this + sizeof(ObjMeta);
@@ -29,11 +369,40 @@ void ObjMeta::destroy() {
   if (!arrayLength)
     return;
   klass->memHandler(klass, ClassMeta::MemRequest::Dctor, this);
+  // the boxes of a page are counted one by one.
+  if (!boxPage) {
+    heapTotals.destroyed++;
+    heapTotals.destroyedBytes += heapBytes(this);
+  }
   arrayLength = 0;
 }
 
+void ObjMeta::destroy(const void* obj) {
+  if (boxPage)
+    BoxSlab::destroy(obj);
+  else
+    destroy();
+}
+
 void ObjMeta::operator delete(void* p) {
   auto* m = (ObjMeta*)p;
+  if (!m->boxPage)
+    heapTotals.freed++;
+#ifdef TGC_FORK_FRIENDLY
+  {
+    unique_lock lk{Collector::inst->mutex, try_to_lock};
+    marks->free(m->color.slot);
+  }
+#endif
+  if (m->inScope) {
+    auto* c = Collector::inst;
+    unique_lock lk{c->mutex, try_to_lock};
+    c->forgetScopeAlloc(m);
+  }
+#ifdef TGC_HEAP_PROFILER
+  if (m->sampled)
+    onSampledFree(m);
+#endif
   m->klass->memHandler(m->klass, ClassMeta::MemRequest::Dealloc, m);
 }
 
@@ -49,6 +418,262 @@ bool ObjMeta::containsPtr(char* p) {
 
 //////////////////////////////////////////////////////////////////////////
 
+// The header at the start of a page, followed by the cells.
+struct BoxSlab::Page {
+  static constexpr size_t MaxCells = PageSize / sizeof(void*);
+  using Bits = uint64_t[MaxCells / 64];
+
+  ObjMeta meta;
+  BoxSlab* slab;
+  Page *prev = nullptr, *next = nullptr;
+  // freed cells, linked through their first word.
+  char* freeCells = nullptr;
+  // cells in use, and the ones ever handed out from the start of the cells.
+  size_t used = 0, carved = 0;
+  // by cell: in use, constructed and not destroyed, referenced by no pointer
+  // yet, and reached by the marking of the current cycle.
+  Bits usedBits = {}, liveBits = {}, pinnedBits = {};
+#ifdef TGC_HEAP_PROFILER
+  // picked by the allocation sampler, looked up when freed.
+  Bits sampledBits = {};
+#endif
+#ifdef TGC_FORK_FRIENDLY
+  // in the mark table, forked children don't copy the page by collecting.
+  uint64_t* markBits = nullptr;
+  static_assert(sizeof(Bits) == MarkTable::BoxBitsWords * sizeof(uint64_t));
+#else
+  Bits markBits = {};
+#endif
+
+  Page(BoxSlab* s) : meta(s, nullptr, 1), slab(s) { meta.boxPage = true; }
+
+  static Page* of(const void* p) {
+    return (Page*)((uintptr_t)p & ~(uintptr_t)(PageSize - 1));
+  }
+  static bool test(const uint64_t* b, size_t i) {
+    return b[i / 64] >> i % 64 & 1;
+  }
+  static void set(uint64_t* b, size_t i) { b[i / 64] |= 1ull << i % 64; }
+  static void clear(uint64_t* b, size_t i) { b[i / 64] &= ~(1ull << i % 64); }
+
+  static constexpr size_t headerSize() { return (sizeof(Page) + 63) / 64 * 64; }
+  size_t capacity() const { return (PageSize - headerSize()) / slab->cellSize; }
+  char* cell(size_t i) {
+    return (char*)this + headerSize() + i * slab->cellSize;
+  }
+  size_t indexOf(const void* cell) const {
+    return ((const char*)cell - (const char*)this - headerSize()) /
+           slab->cellSize;
+  }
+
+  void destroyCell(size_t i) {
+    clear(liveBits, i);
+    slab->dctor(cell(i));
+    heapTotals.destroyed++;
+    heapTotals.destroyedBytes += slab->cellSize;
+  }
+  void freeCell(size_t i) {
+    clear(usedBits, i);
+#ifdef TGC_HEAP_PROFILER
+    if (test(sampledBits, i)) {
+      clear(sampledBits, i);
+      onSampledFree(cell(i));
+    }
+#endif
+    *(char**)cell(i) = freeCells;
+    freeCells = cell(i);
+    heapTotals.freed++;
+    if (used-- == capacity()) {
+      // it was full, so out of the list.
+      next = slab->partial;
+      if (next)
+        next->prev = this;
+      slab->partial = this;
+    }
+  }
+  void unlink() {
+    if (prev)
+      prev->next = next;
+    else
+      slab->partial = next;
+    if (next)
+      next->prev = prev;
+    prev = next = nullptr;
+  }
+};
+
+char* BoxSlab::alloc(ObjMeta*& page) {
+  static_assert(Page::MaxCells * sizeof(void*) <= PageSize);
+  auto* c = Collector::inst ? Collector::inst : Collector::get();
+  char* cell;
+  {
+    unique_lock lk{c->mutex, try_to_lock};
+    if (!partial) {
+      auto* mem = ::operator new(PageSize, align_val_t{PageSize});
+      partial = new (mem) Page(this);
+#ifdef TGC_FORK_FRIENDLY
+      partial->meta.color.slot = marks->alloc();
+      partial->markBits = marks->allocBoxBits();
+#endif
+      c->metaSet.insert(&partial->meta);
+    }
+
+    auto* p = partial;
+    cell = p->freeCells;
+    if (cell)
+      p->freeCells = *(char**)cell;
+    else
+      cell = p->cell(p->carved++);
+    auto i = p->indexOf(cell);
+    Page::set(p->usedBits, i);
+    Page::set(p->liveBits, i);
+    Page::set(p->pinnedBits, i);
+    if (++p->used == p->capacity())
+      p->unlink();
+    page = &p->meta;
+  }
+
+#ifdef TGC_HEAP_PROFILER
+  // by cell as objects are, the page is no allocation of the program.
+  if (auto mean = sampleMeanBytes.load(std::memory_order_relaxed)) {
+    if (maybeSampleAlloc(cell, cellSize, mean)) {
+      unique_lock lk{c->mutex, try_to_lock};
+      auto* p = Page::of(cell);
+      Page::set(p->sampledBits, p->indexOf(cell));
+    }
+  }
+#endif
+
+  heapTotals.allocated++;
+  heapTotals.allocatedBytes += cellSize;
+  auto next = nextHeapThreshold.load(std::memory_order_relaxed);
+  if (next != UINT64_MAX && liveBytes() >= next)
+    c->checkHeapThresholds();
+  return cell;
+}
+
+void BoxSlab::unpin(const void* cell) {
+  auto* c = Collector::inst;
+  unique_lock lk{c->mutex, try_to_lock};
+  auto* p = Page::of(cell);
+  auto i = p->indexOf(cell);
+  Page::clear(p->pinnedBits, i);
+#ifdef TGC_MULTI_THREADED
+  // not traced, as Collector::unpin.
+  if (c->creatingMarked && c->state != Collector::State::Sweeping)
+    Page::set(p->markBits, i);
+#endif
+}
+
+void BoxSlab::free(const void* cell) {
+  unique_lock lk{Collector::inst->mutex, try_to_lock};
+  auto* p = Page::of(cell);
+  auto i = p->indexOf(cell);
+  // the constructor threw, nothing to destruct.
+  Page::clear(p->liveBits, i);
+  Page::clear(p->pinnedBits, i);
+  heapTotals.destroyed++;
+  heapTotals.destroyedBytes += p->slab->cellSize;
+  p->freeCell(i);
+}
+
+void BoxSlab::destroy(const void* cell) {
+  unique_lock lk{Collector::inst->mutex, try_to_lock};
+  auto* p = Page::of(cell);
+  auto i = p->indexOf(cell);
+  if (Page::test(p->liveBits, i))
+    p->destroyCell(i);
+}
+
+void BoxSlab::mark(const void* cell) {
+  auto* p = Page::of(cell);
+  Page::set(p->markBits, p->indexOf(cell));
+}
+
+void BoxSlab::clearMarks(ObjMeta* page) {
+  auto* p = Page::of(page);
+  memset(p->markBits, 0, sizeof(Page::Bits));
+}
+
+#ifdef TGC_FORK_FRIENDLY
+void BoxSlab::renewMarks(ObjMeta* page) {
+  auto* p = Page::of(page);
+  auto* bits = marks->allocBoxBits();
+  memcpy(bits, p->markBits, sizeof(Page::Bits));
+  p->markBits = bits;
+}
+#endif
+
+int BoxSlab::sweep(ObjMeta* page) {
+  auto* p = Page::of(page);
+  int visited = (int)p->used;
+  for (size_t i = 0; i < p->carved; i++) {
+    if (!p->usedBits[i / 64]) {
+      i |= 63;
+      continue;
+    }
+    if (!Page::test(p->usedBits, i) || Page::test(p->markBits, i) ||
+        Page::test(p->pinnedBits, i))
+      continue;
+    if (Page::test(p->liveBits, i))
+      p->destroyCell(i);
+    p->freeCell(i);
+  }
+  memset(p->markBits, 0, sizeof(Page::Bits));
+  return visited;
+}
+
+bool BoxSlab::isSpare(ObjMeta* page) {
+  auto* p = Page::of(page);
+  return !p->used && (p->prev || p->next);
+}
+
+void* BoxSlab::PageHandler(ClassMeta* cls, MemRequest r, void* param) {
+  struct NoPtrs : SlotPtrEnumerator {
+    bool hasNext() override { return false; }
+  };
+
+  switch (r) {
+    case MemRequest::Alloc:
+      assert(!"pages are allocated by BoxSlab::alloc");
+      break;
+    case MemRequest::Dctor: {
+      // the boxes still alive at exit.
+      auto* p = Page::of(param);
+      for (size_t i = 0; i < p->carved; i++) {
+        if (Page::test(p->liveBits, i))
+          p->destroyCell(i);
+      }
+    } break;
+    case MemRequest::Dealloc: {
+      auto* p = Page::of(param);
+#ifdef TGC_HEAP_PROFILER
+      for (size_t i = 0; i < p->carved; i++) {
+        if (Page::test(p->sampledBits, i))
+          onSampledFree(p->cell(i));
+      }
+#endif
+#ifdef TGC_FORK_FRIENDLY
+      {
+        unique_lock lk{Collector::inst->mutex, try_to_lock};
+        marks->freeBoxBits(p->markBits);
+      }
+#endif
+      heapTotals.freed += p->used;
+      if (p->used < p->capacity())
+        p->unlink();
+      ::operator delete(p, align_val_t{PageSize});
+    } break;
+    case MemRequest::NewPtrEnumerator:
+      return new NoPtrs();
+    case MemRequest::TypeName:
+      return (void*)static_cast<BoxSlab*>(cls)->cellTypeName;
+  }
+  return nullptr;
+}
+
+//////////////////////////////////////////////////////////////////////////
+
 bool ObjPtrEnumerator::hasNext() {
   if (auto* subPtrs = meta->klass->subPtrOffsets)
     return arrayElemIdx < meta->arrayLength && subPtrIdx < subPtrs->size();
@@ -64,6 +689,12 @@ const PtrBase* ObjPtrEnumerator::getNext() {
   return (PtrBase*)subPtr;
 }
 
+ObjMeta* IPtrEnumerator::getNextMeta(const void*& obj) {
+  auto* p = getNext();
+  obj = p->ptr;
+  return p->meta;
+}
+
 //////////////////////////////////////////////////////////////////////////
 
 PtrBase::PtrBase() : isRoot(1) {
@@ -71,7 +702,7 @@ PtrBase::PtrBase() : isRoot(1) {
   c->registerPtr(this);
 }
 
-PtrBase::PtrBase(void* obj) : isRoot(1) {
+PtrBase::PtrBase(void* obj) : isRoot(1), ptr(obj) {
   auto* c = Collector::inst ? Collector::inst : Collector::get();
   meta = c->globalFindOwnerMeta(obj);
   c->registerPtr(this);
@@ -85,6 +716,12 @@ void PtrBase::onPtrChanged() {
   Collector::inst->onPointerChanged(this);
 }
 
+#ifdef TGC_MULTI_THREADED
+void PtrBase::onPtrAdopted() {
+  Collector::inst->unpin(meta);
+}
+#endif
+
 //////////////////////////////////////////////////////////////////////////
 
 ObjMeta* ClassMeta::newMeta(size_t objCnt) {
@@ -101,6 +738,15 @@ ObjMeta* ClassMeta::newMeta(size_t objCnt) {
     throw;
   }
 
+#ifdef TGC_HEAP_PROFILER
+  if (auto mean = sampleMeanBytes.load(std::memory_order_relaxed)) {
+    auto bytes = size * objCnt + sizeof(ObjMeta);
+    meta->sampled = maybeSampleAlloc(meta, bytes, mean);
+  }
+#endif
+
+  heapTotals.allocated++;
+  heapTotals.allocatedBytes += heapBytes(meta);
   isCreatingObj++;
   return meta;
 }
@@ -111,16 +757,39 @@ void ClassMeta::endNewMeta(ObjMeta* meta, bool failed) {
     unique_lock lk{mutex};
     state = ClassMeta::State::Registered;
   }
+  auto* c = Collector::inst;
 
   {
-    auto* c = Collector::inst;
     unique_lock lk{c->mutex, try_to_lock};
     c->creatingObjs.remove(meta);
     if (failed) {
+#ifdef TGC_MULTI_THREADED
+      c->unpin(meta);
+#endif
       c->metaSet.erase(meta);
+      if (meta->inScope)
+        c->forgetScopeAlloc(meta);
+      // shaded by a pointer taken in the constructor, rare enough to search.
+      if (meta->color == ObjMeta::Color::Gray)
+        c->grayObjs.erase(find(c->grayObjs.begin(), c->grayObjs.end(), meta));
+#ifdef TGC_FORK_FRIENDLY
+      marks->free(meta->color.slot);
+#endif
+      // the constructor threw, nothing to destruct.
+      heapTotals.destroyed++;
+      heapTotals.destroyedBytes += heapBytes(meta);
+      heapTotals.freed++;
+#ifdef TGC_HEAP_PROFILER
+      if (meta->sampled)
+        onSampledFree(meta);
+#endif
       memHandler(this, MemRequest::Dealloc, meta);
     }
   }
+
+  auto next = nextHeapThreshold.load(std::memory_order_relaxed);
+  if (!failed && next != UINT64_MAX && liveBytes() >= next)
+    c->checkHeapThresholds();
 }
 
 void ClassMeta::registerSubPtr(ObjMeta* owner, PtrBase* p) {
@@ -144,16 +813,54 @@ void ClassMeta::registerSubPtr(ObjMeta* owner, PtrBase* p) {
 
 //////////////////////////////////////////////////////////////////////////
 
+void FramePtrs::add(const PtrBase* p) {
+  auto offset = (unsigned)((const char*)p - begin);
+  auto i = lower_bound(offsets.begin(), offsets.end(), offset);
+  if (i == offsets.end() || *i != offset)
+    offsets.insert(i, offset);
+}
+
+void FramePtrs::remove(const PtrBase* p) {
+  auto offset = (unsigned)((const char*)p - begin);
+  auto i = lower_bound(offsets.begin(), offsets.end(), offset);
+  if (i != offsets.end() && *i == offset)
+    offsets.erase(i);
+}
+
+// A resumption may happen while the frame is running already, e.g. awaiting
+// something ready.
+void FramePtrs::resumed() {
+  if (runningFrame == this)
+    return;
+  resumer = runningFrame;
+  runningFrame = this;
+}
+
+void FramePtrs::suspended() {
+  if (runningFrame == this)
+    runningFrame = resumer;
+}
+
+//////////////////////////////////////////////////////////////////////////
+
 Collector::Collector() {
   pointers.reserve(1024 * 5);
   grayObjs.reserve(1024 * 2);
 }
 
 Collector::~Collector() {
+  sweeping = true;
+  // no barriers, the pointees of the destructed objects may be freed.
+  state = State::RootMarking;
+  nextRootMarking = 0;
   for (auto i = metaSet.begin(); i != metaSet.end();) {
     delete *i;
     i = metaSet.erase(i);
   }
+  for (auto i = permanentSet.begin(); i != permanentSet.end();) {
+    delete *i;
+    i = permanentSet.erase(i);
+  }
 }
 
 Collector* Collector::get() {
@@ -170,29 +877,71 @@ Collector* Collector::get() {
 
 void Collector::addMeta(ObjMeta* meta) {
   unique_lock lk{mutex, try_to_lock};
+#ifdef TGC_FORK_FRIENDLY
+  meta->color.slot = marks->alloc();
+#endif
   metaSet.insert(meta);
   creatingObjs.push_back(meta);
+  if (auto* scope = threadScope) {
+    meta->inScope = true;
+    scope->allocs.insert(meta);
+  }
+#ifdef TGC_MULTI_THREADED
+  meta->pinned = true;
+  pinnedObjs.insert(meta);
+#endif
+}
+
+#ifdef TGC_MULTI_THREADED
+void Collector::unpin(ObjMeta* meta) {
+  unique_lock lk{mutex};
+  if (!meta->pinned)
+    return;
+  meta->pinned = false;
+  pinnedObjs.erase(meta);
+  // not traced, anything it refers to was kept or is pinned as well.
+  if (creatingMarked && state != State::Sweeping &&
+      meta->color == ObjMeta::Color::White)
+    meta->color = ObjMeta::Color::Black;
 }
+#endif
 
 void Collector::registerPtr(PtrBase* p) {
-  p->index = pointers.size();
+  TGC_COUNT(RegisterPtr);
+  ObjMeta* owner = nullptr;
   {
     unique_lock lk{mutex, try_to_lock};
+    // a local of the running frame is traced with the frame, it's not a root.
+    if (auto* frame = runningFrame; frame && frame->contains(p)) {
+      frame->add(p);
+      p->index = FrameIdx;
+      p->isRoot = 0;
+      return;
+    }
+    p->index = pointers.size();
     pointers.push_back(p);
-  }
 
-  if (ClassMeta::isCreatingObj > 0) {
-    if (auto* owner = findCreatingObj(p)) {
-      p->isRoot = 0;
-      owner->klass->registerSubPtr(owner, p);
+    if (ClassMeta::isCreatingObj > 0) {
+      owner = findCreatingObj(p);
+      if (owner)
+        p->isRoot = 0;
     }
   }
+
+  if (owner)
+    owner->klass->registerSubPtr(owner, p);
 }
 
 void Collector::unregisterPtr(PtrBase* p) {
+  TGC_COUNT(UnregisterPtr);
   PtrBase* pointer;
   {
     unique_lock lk{mutex, try_to_lock};
+    if (auto* frame = runningFrame; frame && frame->contains(p))
+      frame->remove(p);
+    // read under the lock, other threads rewrite it when they move p.
+    if (p->index >= FrameIdx)
+      return;
 
     if (p == pointers.back()) {
       pointers.pop_back();
@@ -214,14 +963,57 @@ void Collector::unregisterPtr(PtrBase* p) {
   }
 }
 
-void Collector::tryMarkRoot(PtrBase* p) {
-  if (p->isRoot == 1) {
-    if (p->meta->color == ObjMeta::Color::White) {
-      p->meta->color = ObjMeta::Color::Gray;
+void Collector::unregisterPtrs(IPtrEnumerator* it) {
+  if (it->isSlotEnumerator())
+    return;
+
+  unique_lock lk{mutex, try_to_lock};
 
-      unique_lock lk{mutex, try_to_lock};
-      grayObjs.push_back(p->meta);
+  // pointers moved before nextRootMarking are marked as unregisterPtr does,
+  // once the batch is done as later elements may move them again or be
+  // moved themselves.
+  vector<PtrBase*> moved;
+  while (it->hasNext()) {
+    auto* p = const_cast<PtrBase*>(it->getNext());
+    if (p->index >= FrameIdx)
+      continue;
+    if (p != pointers.back()) {
+      auto* pointer = pointers.back();
+      pointers[p->index] = pointer;
+      pointer->index = p->index;
+      if (state == State::RootMarking && pointer->index < nextRootMarking &&
+          pointer->meta)
+        moved.push_back(pointer);
     }
+    pointers.pop_back();
+    p->index = DetachedIdx;
+  }
+  for (auto* p : moved) {
+    if (p->index != DetachedIdx)
+      tryMarkRoot(p);
+  }
+}
+
+void Collector::tryMarkRoot(PtrBase* p) {
+  if (p->isRoot == 1)
+    markGray(p->meta, p->ptr);
+#ifdef TGC_MULTI_THREADED
+  // objects still pinned may be under construction, see creatingMarked.
+  else if (creatingMarked && !p->meta->pinned)
+    markGray(p->meta, p->ptr);
+#endif
+}
+
+void Collector::markGray(ObjMeta* meta, const void* obj) {
+  if (meta->boxPage) {
+    // boxes hold no pointers, so they are black once marked.
+    unique_lock lk{mutex, try_to_lock};
+    BoxSlab::mark(obj);
+  } else if (meta->color == ObjMeta::Color::White) {
+    meta->color = ObjMeta::Color::Gray;
+
+    unique_lock lk{mutex, try_to_lock};
+    grayObjs.push_back(meta);
   }
 }
 
@@ -230,6 +1022,15 @@ void Collector::onPointerChanged(PtrBase* p) {
     return;
 
   shared_lock lk{mutex, try_to_lock};
+  TGC_COUNT(PointerChanged + (int)state);
+  // a local of a frame is shaded as a slot is, the frame may be black.
+  if (p->index == FrameIdx) {
+    if (state == State::Sweeping)
+      delayToNextCycle(p->meta, p->ptr);
+    else
+      markGray(p->meta, p->ptr);
+    return;
+  }
   switch (state) {
     case State::RootMarking:
       if (p->index < nextRootMarking)
@@ -239,64 +1040,512 @@ void Collector::onPointerChanged(PtrBase* p) {
       tryMarkRoot(p);
       break;
     case State::Sweeping:
-      if (p->meta->color == ObjMeta::Color::White) {
-        if (*p->meta < **nextSweeping) {
-          // already passed sweeping stage.
-        } else {
-          // delay to the next collection.
-          p->meta->color = ObjMeta::Color::Black;
-        }
-      }
+      delayToNextCycle(p->meta, p->ptr);
       break;
   }
 }
 
+// slots have no root flag, shade the new pointee as the owner may be black.
+void Collector::onSlotChanged(ObjMeta* meta, const void* obj) {
+  if (!meta)
+    return;
+
+  shared_lock lk{mutex, try_to_lock};
+  if (state == State::Sweeping)
+    delayToNextCycle(meta, obj);
+  else
+    markGray(meta, obj);
+}
+
+void Collector::delayToNextCycle(ObjMeta* meta, const void* obj) {
+  if (meta->boxPage) {
+    // not swept yet, the page may be the next one.
+    if (nextSweeping != metaSet.end() && !(*meta < **nextSweeping))
+      BoxSlab::mark(obj);
+  } else if (meta->color == ObjMeta::Color::White) {
+    if (nextSweeping == metaSet.end() || *meta < **nextSweeping) {
+      // already passed sweeping stage.
+    } else {
+      // delay to the next collection.
+      meta->color = ObjMeta::Color::Black;
+    }
+  }
+}
+
 ObjMeta* Collector::findCreatingObj(PtrBase* p) {
   shared_lock lk{mutex, try_to_lock};
+  TGC_COUNT(FindCreatingObj);
   // owner may not be the current one(e.g. constructor recursed)
   for (auto i = creatingObjs.rbegin(); i != creatingObjs.rend(); ++i) {
+    TGC_COUNT(CreatingObjsScanned);
     if ((*i)->containsPtr((char*)p))
       return *i;
   }
   return nullptr;
 }
 
+// Free an object right away when its only pointer has just been cleared,
+// instead of waiting for it to be swept.
+void Collector::releaseMeta(ObjMeta* meta) {
+  {
+    unique_lock lk{mutex, try_to_lock};
+    // it's on the gray stack, the sweeping frees it.
+    if (meta->color == ObjMeta::Color::Gray)
+      return;
+    removeMeta(meta);
+    if (meta->inScope)
+      forgetScopeAlloc(meta);
+    if (meta->color == ObjMeta::Color::Permanent) {
+      permanentSet.erase(meta);
+      auto i = find(rememberedObjs.begin(), rememberedObjs.end(), meta);
+      if (i != rememberedObjs.end())
+        *i = nullptr;
+    }
+  }
+  delete meta;
+}
+
+void Collector::removeMeta(ObjMeta* meta) {
+  if (state == State::Sweeping && nextSweeping != metaSet.end() &&
+      *nextSweeping == meta)
+    ++nextSweeping;
+  metaSet.erase(meta);
+}
+
 ObjMeta* Collector::globalFindOwnerMeta(void* obj) {
   shared_lock lk{mutex, try_to_lock};
+  TGC_COUNT(GlobalFindOwnerMeta);
 
   ObjMeta dummyMeta(&ClassMeta::dummy, 0, 0);
   dummyMeta.dummyObjPtr = (char*)obj;
-  auto i = metaSet.lower_bound(&dummyMeta);
-  if (i != metaSet.end() && (*i)->containsPtr((char*)obj)) {
-    return *i;
-  } else {
-    return nullptr;
+  for (auto* set : {&metaSet, &permanentSet}) {
+    auto i = set->lower_bound(&dummyMeta);
+    if (i != set->end() && (*i)->containsPtr((char*)obj))
+      return *i;
   }
+  return nullptr;
 }
 
 void Collector::collect(int stepCnt) {
+  vector<GcEventInfo> events;
+  {
+    unique_lock lk{mutex};
+    collectSteps(stepCnt);
+    events.swap(pendingEvents);
+  }
+  if (events.size())
+    EventHub::get().notify(events);
+}
+
+void Collector::collectFull() {
+  vector<GcEventInfo> events;
+  {
+    unique_lock lk{mutex};
+    // an unfinished cycle is finished by the full marking, it's neither
+    // counted nor announced again.
+    if (inCycle) {
+      for (auto* i : metaSet) {
+        i->color = ObjMeta::Color::White;
+        if (i->boxPage)
+          BoxSlab::clearMarks(i);
+      }
+      grayObjs.clear();
+    } else {
+      inCycle = true;
+      cycleCnt++;
+      cycleStartSteps = stepsDone;
+      cycleStartAllocs = heapTotals.allocated;
+      cycleStartObjs = heapObjs();
+      queueEvent(GcEvent::CycleStart);
+    }
+#ifdef TGC_MULTI_THREADED
+    creatingMarked = false;
+#endif
+    state = State::LeafMarking;
+    nextRootMarking = 0;
+    nextRemembered = 0;
+    queueEvent(GcEvent::PhaseChange);
+
+    stepsDone += markFull();
+    sweepStartSteps = stepsDone;
+
+    // sweeps as the incremental cycle does, the barriers of the destructors
+    // see a sweeping collector.
+    state = State::Sweeping;
+    nextSweeping = metaSet.begin();
+    queueEvent(GcEvent::PhaseChange);
+    collectSteps(INT_MAX, true);
+    events.swap(pendingEvents);
+  }
+  if (events.size())
+    EventHub::get().notify(events);
+}
+
+#ifdef TGC_MULTI_THREADED
+void Collector::setMarkThreads(unsigned n) {
+  unique_lock lk{mutex};
+  markThreads = max(n, 1u);
+}
+#endif
+
+void Collector::prepareFork() {
+  collectFull();
+  {
+    unique_lock lk{mutex};
+    grayObjs.shrink_to_fit();
+#ifdef TGC_FORK_FRIENDLY
+    // the live objects get the first slots in the order of their addresses,
+    // so the colors a child writes are on as few pages as possible. The mark
+    // bits of the box pages follow theirs.
+    auto* sparse = marks;
+    marks = new MarkTable();
+    for (auto* set : {&metaSet, &permanentSet}) {
+      for (auto* i : *set) {
+        auto slot = marks->alloc();
+        (*marks)[slot] = (*sparse)[i->color.slot];
+        i->color.slot = slot;
+        if (i->boxPage)
+          BoxSlab::renewMarks(i);
+      }
+    }
+    delete sparse;
+#endif
+  }
+#ifdef __GLIBC__
+  // the garbage just freed shouldn't be inherited by the children.
+  malloc_trim(0);
+#endif
+}
+
+bool Collector::markRemembered(int& stepCnt) {
+  if (!nextRemembered) {
+    rememberedObjs.erase(
+        remove(rememberedObjs.begin(), rememberedObjs.end(), nullptr),
+        rememberedObjs.end());
+  }
+  for (; nextRemembered < rememberedObjs.size(); nextRemembered++) {
+    if (stepCnt <= 0)
+      return false;
+    auto* o = rememberedObjs[nextRemembered];
+    stepCnt--;
+    if (!o || !o->arrayLength)
+      continue;
+    auto it = o->klass->enumPtrs(o);
+    for (; it->hasNext(); stepCnt--) {
+      const void* obj;
+      if (auto* meta = it->getNextMeta(obj))
+        markGray(meta, obj);
+    }
+    delete it;
+  }
+  nextRemembered = 0;
+  return true;
+}
+
+void Collector::forgetScopeAlloc(ObjMeta* meta) {
+  for (auto* scope : permanentScopes) {
+    if (scope->allocs.erase(meta))
+      break;
+  }
+  meta->inScope = false;
+}
+
+void Collector::makePermanent(ObjMeta* root) {
+  unique_lock lk{mutex};
+  makePermanentLocked(root);
+}
+
+void Collector::makePermanentLocked(ObjMeta* root) {
+  vector<ObjMeta*> todo;
+  auto add = [&](ObjMeta* meta) {
+    // boxes are not made permanent, their pages are shared.
+    if (!meta || meta->boxPage || meta->color == ObjMeta::Color::Permanent ||
+        find(creatingObjs.begin(), creatingObjs.end(), meta) !=
+            creatingObjs.end())
+      return;
+    removeMeta(meta);
+    meta->color = ObjMeta::Color::Permanent;
+    permanentSet.insert(meta);
+    heapTotals.permanent++;
+    todo.push_back(meta);
+  };
+
+  add(root);
+  while (todo.size()) {
+    auto* o = todo.back();
+    todo.pop_back();
+    if (!o->arrayLength)
+      continue;
+    auto it = o->klass->enumPtrs(o);
+    if (it->isSlotEnumerator()) {
+      rememberedObjs.push_back(o);
+      const void* obj;
+      while (it->hasNext())
+        add(it->getNextMeta(obj));
+    } else {
+      // the pointers into the rest of the heap assigned later are roots,
+      // pointers of containers included.
+      while (it->hasNext()) {
+        auto* p = it->getNext();
+        p->isRoot = 1;
+        add(p->getMeta());
+      }
+    }
+    delete it;
+  }
+}
+
+void Collector::beginPermanentScope() {
+  if (!threadScope) {
+    threadScope = new PermanentScope();
+    unique_lock lk{mutex};
+    permanentScopes.push_back(threadScope);
+  }
+  threadScope->depth++;
+}
+
+void Collector::endPermanentScope() {
+  auto* scope = threadScope;
+  if (--scope->depth)
+    return;
+  // the scope still records the frees of the temporaries.
+  collectFull();
+  threadScope = nullptr;
   unique_lock lk{mutex};
+  permanentScopes.remove(scope);
+  for (auto* i : scope->allocs) {
+    i->inScope = false;
+    makePermanentLocked(i);
+  }
+  delete scope;
+}
+
+uint64_t Collector::markFull() {
+  uint64_t steps = 0;
+  auto mark = [this](ObjMeta* meta, const void* obj) {
+    if (!meta)
+      return;
+    if (meta->boxPage) {
+      BoxSlab::mark(obj);
+    } else if (meta->color == ObjMeta::Color::White) {
+      meta->color = ObjMeta::Color::Gray;
+      grayObjs.push_back(meta);
+    }
+  };
+
+  // fields of objects being constructed can't be traced, keep them and
+  // whatever any pointer refers to. Their garbage waits for the next cycle.
+  bool conservative = creatingObjs.size();
+  for (auto* i : creatingObjs)
+    i->color = ObjMeta::Color::Black;
+
+  // pointers of containers are registered as roots, clear them once per
+  // container instead of once per pointer to it.
+  for (auto* meta : metaSet) {
+    if (meta->klass->plainPtrs || !meta->arrayLength ||
+        meta->color != ObjMeta::Color::White)
+      continue;
+    auto it = meta->klass->enumPtrs(meta);
+    if (!it->isSlotEnumerator()) {
+      for (; it->hasNext(); steps++) {
+        // read first, writing would copy a page shared with a forked parent.
+        auto* p = it->getNext();
+        if (p->isRoot)
+          p->isRoot = 0;
+      }
+    }
+    delete it;
+  }
+
+  steps += pointers.size();
+  for (auto* p : pointers) {
+    if (p->isRoot == 1 || conservative)
+      mark(p->meta, p->ptr);
+  }
+#ifdef TGC_MULTI_THREADED
+  for (auto* i : pinnedObjs)
+    mark(i, nullptr);
+#endif
+  int budget = INT_MAX;
+  markRemembered(budget);
+  steps += INT_MAX - budget;
+
+#if defined(TGC_MULTI_THREADED) && !defined(TGC_FORK_FRIENDLY)
+  if (markThreads > 1 && grayObjs.size() &&
+      metaSet.size() >= ParallelMarkMinObjs)
+    return steps + markParallel(markThreads);
+#endif
+  while (grayObjs.size()) {
+    ObjMeta* o = grayObjs.back();
+    grayObjs.pop_back();
+    steps++;
+    // made permanent since.
+    if (o->color != ObjMeta::Color::Gray)
+      continue;
+    o->color = ObjMeta::Color::Black;
+    if (o->arrayLength)
+      steps += tracePtrs(o, mark);
+  }
+  return steps;
+}
+
+template <typename F>
+uint64_t Collector::tracePtrs(ObjMeta* o, F&& mark) {
+  auto cls = o->klass;
+  if (cls->plainPtrs) {
+    // the pointers ObjPtrEnumerator would return, without its virtual calls.
+    auto* offsets = cls->subPtrOffsets;
+    if (!offsets)
+      return 0;
+    auto* obj = o->objPtr();
+    for (auto i : *offsets) {
+      auto* p = (PtrBase*)(obj + i);
+      mark(p->meta, p->ptr);
+    }
+    return offsets->size();
+  }
+  uint64_t ptrs = 0;
+  auto it = cls->enumPtrs(o);
+  for (; it->hasNext(); ptrs++) {
+    const void* obj;
+    auto* meta = it->getNextMeta(obj);
+    mark(meta, obj);
+  }
+  delete it;
+  return ptrs;
+}
+
+#if defined(TGC_MULTI_THREADED) && !defined(TGC_FORK_FRIENDLY)
+// Each worker traces from its own stack and shades an object by winning the
+// exchange of its color, handing batches of its stack over to idle workers.
+// The mutators are blocked on the lock of the collector meanwhile. Boxes are
+// marked once the workers are done, the bits of a page are not atomic.
+uint64_t Collector::markParallel(unsigned workers) {
+  constexpr size_t Batch = 64;
+  struct Pool {
+    std::mutex mutex;
+    condition_variable cv;
+    vector<vector<ObjMeta*>> batches;
+    atomic<unsigned> idle = 0;
+    bool done = false;
+  } pool;
+  for (size_t i = 0; i < grayObjs.size(); i += Batch) {
+    auto end = min(i + Batch, grayObjs.size());
+    pool.batches.emplace_back(grayObjs.begin() + i, grayObjs.begin() + end);
+  }
+  grayObjs.clear();
+
+  vector<uint64_t> steps(workers);
+  vector<vector<const void*>> boxes(workers);
+  auto work = [&](unsigned id) {
+    vector<ObjMeta*> stack;
+    auto mark = [&](ObjMeta* meta, const void* obj) {
+      if (!meta)
+        return;
+      auto white = ObjMeta::Color::White;
+      if (meta->boxPage)
+        boxes[id].push_back(obj);
+      else if (meta->color.compare_exchange_strong(white,
+                                                    ObjMeta::Color::Gray))
+        stack.push_back(meta);
+    };
+    for (;;) {
+      if (stack.empty()) {
+        unique_lock lk{pool.mutex};
+        pool.idle++;
+        while (pool.batches.empty() && !pool.done) {
+          if (pool.idle == workers) {
+            pool.done = true;
+            pool.cv.notify_all();
+          } else {
+            pool.cv.wait(lk);
+          }
+        }
+        if (pool.done)
+          break;
+        pool.idle--;
+        stack = move(pool.batches.back());
+        pool.batches.pop_back();
+      }
+
+      ObjMeta* o = stack.back();
+      stack.pop_back();
+      steps[id]++;
+      o->color = ObjMeta::Color::Black;
+      if (o->arrayLength)
+        steps[id] += tracePtrs(o, mark);
+
+      if (stack.size() >= Batch * 2 && pool.idle) {
+        unique_lock lk{pool.mutex};
+        pool.batches.emplace_back(stack.begin(), stack.begin() + Batch);
+        stack.erase(stack.begin(), stack.begin() + Batch);
+        pool.cv.notify_one();
+      }
+    }
+  };
+
+  vector<thread> threads;
+  for (unsigned i = 1; i < workers; i++)
+    threads.emplace_back(work, i);
+  work(0);
+  for (auto& i : threads)
+    i.join();
+
+  uint64_t total = 0;
+  for (unsigned i = 0; i < workers; i++) {
+    total += steps[i];
+    for (auto* cell : boxes[i])
+      BoxSlab::mark(cell);
+  }
+  return total;
+}
+#endif
+
+int Collector::collectSteps(int stepCnt, bool onePhase) {
+  // steps ever run are stepsEnd - stepCnt.
+  auto stepsEnd = stepsDone + stepCnt;
 
   switch (state) {
   _RootMarking:
   case State::RootMarking:
+    if (!inCycle) {
+      inCycle = true;
+#ifdef TGC_MULTI_THREADED
+      creatingWaits = 0;
+      creatingMarked = false;
+#endif
+      cycleCnt++;
+      cycleStartSteps = stepsEnd - stepCnt;
+      cycleStartAllocs = heapTotals.allocated;
+      cycleStartObjs = heapObjs();
+      queueEvent(GcEvent::CycleStart);
+    }
     for (; nextRootMarking < pointers.size() && stepCnt-- > 0;
          nextRootMarking++) {
       auto p = pointers[nextRootMarking];
       auto meta = p->meta;
-      if (!meta)
+      if (!meta || meta->color == ObjMeta::Color::Permanent)
         continue;
       // for containers
       auto it = meta->klass->enumPtrs(meta);
-      for (; it->hasNext();) {
-        it->getNext()->isRoot = 0;
+      if (!it->isSlotEnumerator()) {
+        for (; it->hasNext();) {
+          auto* c = it->getNext();
+          if (c->isRoot)
+            c->isRoot = 0;
+        }
       }
       delete it;
       tryMarkRoot(p);
     }
     if (nextRootMarking >= pointers.size()) {
+      if (!markRemembered(stepCnt))
+        break;
       state = State::LeafMarking;
       nextRootMarking = 0;
+      queueEvent(GcEvent::PhaseChange);
+      if (onePhase)
+        break;
       goto _ChildMarking;
     }
     break;
@@ -306,48 +1555,431 @@ void Collector::collect(int stepCnt) {
     while (grayObjs.size() && stepCnt-- > 0) {
       ObjMeta* o = grayObjs.back();
       grayObjs.pop_back();
+      // made permanent since.
+      if (o->color != ObjMeta::Color::Gray)
+        continue;
       o->color = ObjMeta::Color::Black;
 
       auto cls = o->klass;
       auto it = cls->enumPtrs(o);
       for (; it->hasNext(); stepCnt--) {
-        auto* ptr = it->getNext();
-        auto* meta = ptr->meta;
+        const void* obj;
+        auto* meta = it->getNextMeta(obj);
         if (!meta)
           continue;
-        if (meta->color == ObjMeta::Color::White) {
+        if (meta->boxPage) {
+          BoxSlab::mark(obj);
+        } else if (meta->color == ObjMeta::Color::White) {
           meta->color = ObjMeta::Color::Gray;
           grayObjs.push_back(meta);
         }
       }
       delete it;
     }
+#ifdef TGC_MULTI_THREADED
+    if (!grayObjs.size()) {
+      // fields of objects being constructed can't be traced yet, wait for
+      // them before sweeping, or keep what any pointer refers to.
+      if (creatingObjs.size() && !creatingMarked) {
+        if (++creatingWaits < MaxCreatingWaits)
+          break;
+        // mark again with every pointer as a root, as incrementally.
+        for (auto* i : creatingObjs)
+          i->color = ObjMeta::Color::Black;
+        creatingMarked = true;
+        state = State::RootMarking;
+        nextRootMarking = 0;
+        queueEvent(GcEvent::PhaseChange);
+        if (onePhase)
+          break;
+        goto _RootMarking;
+      }
+      for (auto* i : pinnedObjs) {
+        // maybe under construction, what it refers to is kept already.
+        if (creatingMarked && i->color == ObjMeta::Color::White)
+          i->color = ObjMeta::Color::Black;
+        else
+          markGray(i, nullptr);
+      }
+      if (grayObjs.size())
+        goto _ChildMarking;
+    }
+#endif
     if (!grayObjs.size()) {
       state = State::Sweeping;
+      sweepStartSteps = stepsEnd - stepCnt;
       nextSweeping = metaSet.begin();
+      queueEvent(GcEvent::PhaseChange);
+      if (onePhase)
+        break;
       goto _Sweeping;
     }
     break;
 
   _Sweeping:
   case State::Sweeping:
+    sweeping = true;
     for (; nextSweeping != metaSet.end() && stepCnt-- > 0;) {
       ObjMeta* meta = *nextSweeping;
+      if (meta->boxPage) {
+        stepCnt -= BoxSlab::sweep(meta);
+        if (BoxSlab::isSpare(meta)) {
+          nextSweeping = metaSet.erase(nextSweeping);
+          delete meta;
+        } else {
+          ++nextSweeping;
+        }
+        continue;
+      }
+#ifdef TGC_MULTI_THREADED
+      if (meta->color == ObjMeta::Color::White && !meta->pinned) {
+#else
       if (meta->color == ObjMeta::Color::White) {
+#endif
+#ifdef TGC_AGE_STATS
+        recordAge(meta, true);
+#endif
         nextSweeping = metaSet.erase(nextSweeping);
         delete meta;
         continue;
       }
+#ifdef TGC_AGE_STATS
+      recordAge(meta, false);
+#endif
       meta->color = ObjMeta::Color::White;
       ++nextSweeping;
     }
+    sweeping = false;
     if (nextSweeping == metaSet.end()) {
+#ifdef TGC_AGE_STATS
+      lastCycleAges = sweepingAges;
+      for (auto& i : sweepingAges)
+        i = GcAgeHistogram{i.className};
+#endif
       state = State::RootMarking;
-      if (metaSet.size())
+      inCycle = false;
+      {
+        // the cycle dealt with the objects it started with and the ones
+        // allocated meanwhile.
+        double mark = (double)(sweepStartSteps - cycleStartSteps);
+        double sweep = (double)(stepsEnd - stepCnt - sweepStartSteps);
+        double objs = max((double)(cycleStartObjs + heapTotals.allocated -
+                                   cycleStartAllocs),
+                          1.0);
+        pacer.markStepsPerObject =
+            pacer.markStepsPerObject * 0.5 + mark / objs * 0.5;
+        pacer.sweepStepsPerObject =
+            pacer.sweepStepsPerObject * 0.5 + sweep / objs * 0.5;
+      }
+      queueEvent(GcEvent::PhaseChange);
+      queueEvent(GcEvent::CycleEnd);
+      {
+        // rearm the thresholds the live bytes fell below.
+        auto& hub = EventHub::get();
+        unique_lock lk{hub.mutex};
+        auto live = liveBytes();
+        while (hub.crossed && live < hub.thresholds[hub.crossed - 1])
+          hub.crossed--;
+        hub.updateNextThreshold();
+      }
+      // the page kept for the next boxes is not worth a cycle.
+      if (heapObjs() && !onePhase)
         goto _RootMarking;
     }
     break;
   }
+  stepsDone = stepsEnd - stepCnt;
+  return stepCnt;
+}
+
+void Collector::collectAuto() {
+  // keeps the collector going while nothing is allocated, pointers may be
+  // dropped anyway.
+  const int minSteps = 64;
+
+  int steps;
+  {
+    unique_lock lk{mutex};
+    uint64_t allocs = heapTotals.allocated;
+    auto newAllocs = autoStarted ? allocs - lastAutoAllocs : 0;
+    lastAutoAllocs = allocs;
+    if (autoStarted)
+      pacer.allocsPerCall = pacer.allocsPerCall * 0.75 + newAllocs * 0.25;
+    autoStarted = true;
+
+    // small heaps are not collected at every allocation.
+    const uint64_t minBudget = 1024;
+    auto objs = heapObjs();
+    auto markWork = pacer.markStepsPerObject * objs;
+    auto sweepWork = pacer.sweepStepsPerObject * objs;
+    pacer.cycleWork = (uint64_t)(markWork + sweepWork);
+    pacer.allocBudget =
+        max<uint64_t>(inCycle ? cycleStartObjs : objs, minBudget);
+    pacer.cycleAllocs = inCycle ? allocs - cycleStartAllocs : 0;
+    pacer.cycleSteps = inCycle ? stepsDone - cycleStartSteps : 0;
+    // by the phase, a phase running over its estimate has a quarter of it
+    // left, guessed.
+    auto workLeft = (double)pacer.cycleWork;
+    if (inCycle && state == State::Sweeping) {
+      workLeft = max(sweepWork - (double)(stepsDone - sweepStartSteps),
+                     sweepWork * 0.25);
+    } else if (inCycle) {
+      workLeft = max(markWork - (double)pacer.cycleSteps, markWork * 0.25) +
+                 sweepWork;
+    }
+    // aim at finishing with half of the budget, the other half absorbs a
+    // wrong estimate instead of a long pause.
+    auto allocsLeft = (double)pacer.allocBudget - (double)pacer.cycleAllocs;
+    if (allocsLeft > pacer.allocBudget / 2)
+      allocsLeft -= pacer.allocBudget / 2;
+
+    // spread the work left over the allocations left, at least at the rate
+    // finishing a whole cycle within the budget.
+    auto minRate = (double)pacer.cycleWork / pacer.allocBudget;
+    pacer.stepsPerAlloc = minRate;
+    if (allocsLeft > 0)
+      pacer.stepsPerAlloc = max(pacer.stepsPerAlloc, workLeft / allocsLeft);
+    // the catching up is spread by the learned allocations of a call, so a
+    // burst of allocations doesn't get it at once. The allocations of this
+    // call still get the minimal rate.
+    auto want = max(newAllocs * minRate,
+                    pacer.allocsPerCall * pacer.stepsPerAlloc);
+    if (inCycle && allocsLeft <= 0) {
+      // the heap has doubled, finish the cycle now. It's at least as large
+      // as estimated by now.
+      want = max<double>(want, workLeft);
+      pacer.behind++;
+    }
+    steps = (int)min<double>(max<double>(want, minSteps), INT_MAX / 2);
+    pacer.lastSteps = steps;
+  }
+
+  collect(steps);
+}
+
+GcPacerStats Collector::pacerStats() {
+  shared_lock lk{mutex};
+  return pacer;
+}
+
+bool Collector::idle(chrono::steady_clock::time_point deadline) {
+  using Clock = chrono::steady_clock;
+  // too short to be worth locking and checking the clock.
+  const int minSteps = 32;
+
+  bool cycleEnded = false;
+  vector<GcEventInfo> events;
+  for (;;) {
+    auto start = Clock::now();
+    if (start >= deadline)
+      break;
+
+    unique_lock lk{mutex};
+    auto phase = (int)state;
+    auto budgetNs =
+        (double)chrono::duration_cast<chrono::nanoseconds>(deadline - start)
+            .count();
+    // half of the time left, so a wrong estimate is corrected by the next
+    // units before the deadline.
+    auto steps = (int)min(budgetNs / 2 / stepCostNs[phase], 1e8);
+    if (steps < minSteps)
+      break;
+
+    // a unit never crosses a phase, so its time tells the cost of the phase.
+    auto used = steps - collectSteps(steps, true);
+    auto ns = (double)chrono::duration_cast<chrono::nanoseconds>(
+                  Clock::now() - start)
+                  .count();
+    if (used > 0)
+      stepCostNs[phase] = stepCostNs[phase] * 0.75 + ns / used * 0.25;
+    events.insert(events.end(), pendingEvents.begin(), pendingEvents.end());
+    pendingEvents.clear();
+
+    if (state == State::RootMarking && !inCycle) {
+      // the gray objects of the marking may have been as many as the
+      // objects. Shrinking the pointer registry would copy all of it.
+      grayObjs.shrink_to_fit();
+      cycleEnded = true;
+      break;
+    }
+    // e.g. waiting for objects being constructed by other threads.
+    if (used <= 0 && (int)state == phase)
+      break;
+  }
+
+  if (events.size())
+    EventHub::get().notify(events);
+  return cycleEnded;
+}
+
+#ifdef TGC_AGE_STATS
+
+void Collector::recordAge(ObjMeta* meta, bool died) {
+  auto* cls = meta->klass;
+  if (cls->ageStatsIdx < 0) {
+    cls->ageStatsIdx = (int)sweepingAges.size();
+    sweepingAges.push_back(GcAgeHistogram{cls->typeName()});
+  }
+  auto& h = sweepingAges[cls->ageStatsIdx];
+#ifdef TGC_FORK_FRIENDLY
+  auto& metaAge = (*marks)[meta->color.slot].age;
+#else
+  auto& metaAge = meta->age;
+#endif
+  auto age = min<int>(metaAge, GcAgeHistogram::MaxAge);
+  if (died) {
+    h.died[age]++;
+  } else {
+    h.survived[age]++;
+    if (metaAge < UCHAR_MAX)
+      metaAge++;
+  }
+}
+
+vector<GcAgeHistogram> Collector::ageStats() {
+  shared_lock lk{mutex};
+  vector<GcAgeHistogram> r;
+  for (auto& i : lastCycleAges) {
+    for (int a = 0; a <= GcAgeHistogram::MaxAge; a++) {
+      if (i.survived[a] || i.died[a]) {
+        r.push_back(i);
+        break;
+      }
+    }
+  }
+  return r;
+}
+
+#endif
+
+#ifdef TGC_COUNTERS
+
+namespace {
+std::mutex countersMutex;
+
+vector<ThreadCounters*>& threadCounters() {
+  static auto* inst = new vector<ThreadCounters*>();
+  return *inst;
+}
+}  // namespace
+
+ThreadCounters::ThreadCounters() {
+  std::lock_guard<std::mutex> lk{countersMutex};
+  threadCounters().push_back(this);
+}
+
+void ThreadCounters::addTo(GcCounters& r) const {
+  auto get = [&](int id) { return counters[id].load(memory_order_relaxed); };
+  r.registerPtr += get(RegisterPtr);
+  r.unregisterPtr += get(UnregisterPtr);
+  for (int i = 0; i < 3; i++)
+    r.pointerChanged[i] += get(PointerChanged + i);
+  r.findCreatingObj += get(FindCreatingObj);
+  r.creatingObjsScanned += get(CreatingObjsScanned);
+  r.globalFindOwnerMeta += get(GlobalFindOwnerMeta);
+}
+
+GcCounters ThreadCounters::sum() {
+  std::lock_guard<std::mutex> lk{countersMutex};
+  GcCounters r;
+  for (auto* i : threadCounters())
+    i->addTo(r);
+  return r;
+}
+
+void ThreadCounters::reset() {
+  std::lock_guard<std::mutex> lk{countersMutex};
+  for (auto* i : threadCounters())
+    for (auto& c : i->counters)
+      c.store(0, memory_order_relaxed);
+}
+
+#endif
+
+void Collector::queueEvent(GcEvent event) {
+  if (!hasEventListeners.load(std::memory_order_relaxed))
+    return;
+  pendingEvents.push_back(GcEventInfo{event, state, cycleCnt, 0, stats()});
+}
+
+void Collector::checkHeapThresholds() {
+  GcEventInfo e{GcEvent::HeapThreshold, GcState::RootMarking, 0, 0, {}};
+  bool inSweeping;
+  {
+    shared_lock lk{mutex};
+    e.state = state;
+    e.cycle = cycleCnt;
+    // only the thread sweeping sees it set, it holds the lock.
+    inSweeping = sweeping;
+  }
+
+  vector<GcEventInfo> events;
+  auto& hub = EventHub::get();
+  {
+    unique_lock lk{hub.mutex};
+    auto live = liveBytes();
+    for (; hub.crossed < hub.thresholds.size() &&
+           live >= hub.thresholds[hub.crossed];
+         hub.crossed++) {
+      e.threshold = hub.thresholds[hub.crossed];
+      events.push_back(e);
+    }
+    hub.updateNextThreshold();
+  }
+  if (events.empty() || !hasEventListeners)
+    return;
+  auto s = stats();
+  for (auto& i : events)
+    i.stats = s;
+  // allocated by a destructor the sweeper runs, they are notified with the
+  // events of the collection once it unlocks.
+  if (inSweeping) {
+    unique_lock lk{mutex};
+    pendingEvents.insert(pendingEvents.end(), events.begin(), events.end());
+    return;
+  }
+  hub.notify(events);
+}
+
+int gc_add_event_listener(GcEventListener listener) {
+  auto& hub = EventHub::get();
+  unique_lock lk{hub.mutex};
+  hub.listeners.emplace_back(hub.nextId, std::move(listener));
+  hasEventListeners = true;
+  return hub.nextId++;
+}
+
+void gc_remove_event_listener(int id) {
+  auto& hub = EventHub::get();
+  unique_lock lk{hub.mutex};
+  auto& ls = hub.listeners;
+  ls.erase(remove_if(ls.begin(), ls.end(),
+                     [id](auto& i) { return i.first == id; }),
+           ls.end());
+  hasEventListeners = !ls.empty();
+}
+
+void gc_set_heap_thresholds(vector<uint64_t> liveBytes) {
+  sort(liveBytes.begin(), liveBytes.end());
+  auto& hub = EventHub::get();
+  unique_lock lk{hub.mutex};
+  hub.thresholds = std::move(liveBytes);
+  hub.crossed = 0;
+  hub.updateNextThreshold();
+}
+
+// An object is counted allocated, then destroyed, then freed. Reading the
+// totals the other way round keeps freed <= destroyed <= allocated while
+// other threads update them.
+GcStats Collector::stats() {
+  GcStats r;
+  r.permanent = heapTotals.permanent;
+  r.freed = heapTotals.freed;
+  r.destroyedBytes = heapTotals.destroyedBytes;
+  r.destroyed = heapTotals.destroyed;
+  r.allocatedBytes = heapTotals.allocatedBytes;
+  r.allocated = heapTotals.allocated;
+  return r;
 }
 
 void Collector::dumpStats() {
@@ -356,13 +1988,30 @@ void Collector::dumpStats() {
   printf("========= [gc] ========\n");
   printf("[total pointers ] %3d\n", (unsigned)pointers.size());
   printf("[total meta     ] %3d\n", (unsigned)metaSet.size());
+  printf("[permanent meta ] %3d\n", (unsigned)permanentSet.size());
   printf("[total gray meta] %3d\n", (unsigned)grayObjs.size());
-  auto liveCnt = 0;
-  for (auto i : metaSet)
-    if (i->arrayLength)
-      liveCnt++;
-  printf("[live objects   ] %3d\n", liveCnt);
+  auto s = stats();
+  printf("[live objects   ] %3llu\n", (unsigned long long)s.live());
+  printf("[live bytes     ] %3llu\n", (unsigned long long)s.liveBytes());
+  printf("[pending free   ] %3llu\n", (unsigned long long)s.pendingFree());
   printf("[collector state] %s\n", StateStr[(int)state]);
+#ifdef TGC_AGE_STATS
+  // survived/died by age in the last completed cycle.
+  for (auto& i : lastCycleAges) {
+    bool swept = false;
+    for (int a = 0; a <= GcAgeHistogram::MaxAge; a++) {
+      if (!i.survived[a] && !i.died[a])
+        continue;
+      if (!swept)
+        printf("[ages] %s:", i.className);
+      swept = true;
+      printf(" %d%s:%llu/%llu", a, a == GcAgeHistogram::MaxAge ? "+" : "",
+             (unsigned long long)i.survived[a], (unsigned long long)i.died[a]);
+    }
+    if (swept)
+      printf("\n");
+  }
+#endif
   printf("=======================\n");
 }
 
@@ -29,14 +29,64 @@ CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 
 //#define TGC_MULTI_THREADED
 
+// max bytes of a closure (including its vtable pointer) stored inside
+// gc_function without allocating from the gc heap. Every gc_function has the
+// buffer, also the ones in gc objects which never use it, 0 removes it.
+#ifndef TGC_FUNCTION_INLINE_SIZE
+#define TGC_FUNCTION_INLINE_SIZE (sizeof(void*) * 6)
+#endif
+
+// define TGC_COUNTERS to count calls of the pointer registry hot paths, see
+// gc_counters().
+//#define TGC_COUNTERS
+
+// define TGC_HEAP_PROFILER to sample allocations with their call stacks, see
+// gc_heap_profiler_start().
+//#define TGC_HEAP_PROFILER
+
+// define TGC_AGE_STATS to record the count of collection cycles every object
+// survived and histograms of them per class, see gc_age_stats().
+//#define TGC_AGE_STATS
+
+// define TGC_FORK_FRIENDLY to keep the colors of the objects in a side table
+// instead of their ObjMeta, so a forked child collecting doesn't copy the
+// pages of the heap it shares with its parent, see gc_prepare_fork().
+//#define TGC_FORK_FRIENDLY
+
+// the side table is not synchronized like the colors in ObjMeta are.
+#if defined(TGC_FORK_FRIENDLY) && defined(TGC_MULTI_THREADED)
+#error "TGC_FORK_FRIENDLY does not support TGC_MULTI_THREADED"
+#endif
+
+// max freed gc_function closures kept for reuse per closure type.
+#ifndef TGC_FUNCTION_POOL_SIZE
+#define TGC_FUNCTION_POOL_SIZE 256
+#endif
+
+#include <algorithm>
 #include <cassert>
+#include <chrono>
+#include <cstdint>
+#include <functional>
 #include <memory>
 #include <set>
+#include <type_traits>
 #include <typeinfo>
 #include <vector>
 #ifdef TGC_MULTI_THREADED
 #include <atomic>
+#include <mutex>
 #include <shared_mutex>
+#include <unordered_set>
+#endif
+#ifdef TGC_COUNTERS
+#include <atomic>
+#include <mutex>
+#endif
+#ifdef __cpp_impl_coroutine
+#include <coroutine>
+#include <exception>
+#include <optional>
 #endif
 
 // for STL wrappers
@@ -68,35 +118,261 @@ struct atomic {
   atomic(T v) : value{v} {}
   void operator++(int) { value++; }
   void operator--(int) { value--; }
+  T operator--() { return --value; }
+  void operator+=(const T& v) { value += v; }
   operator const T&() const { return value; }
   bool operator==(const T& r) const { return value == r; }
 };
 
+using CollectorMutex = shared_mutex;
+using ClassMutex = shared_mutex;
+
+#else
+
+#ifdef TGC_LOCK_STATS
+// contention of the locks of the multi-threaded version, e.g. for
+// benchmarking.
+struct LockStats {
+  atomic<uint64_t> locks{0};
+  atomic<uint64_t> contended{0};
+  atomic<uint64_t> waitNs{0};
+
+  void reset() {
+    locks = 0;
+    contended = 0;
+    waitNs = 0;
+  }
+};
+
+inline LockStats collectorLockStats;
+inline LockStats classLockStats;
+#else
+struct LockStats;
+#endif
+
+// The collector reenters its mutex, e.g. destructors called by sweeping
+// unregister their pointers, so it's recursive and locked exclusively. Its
+// try_to_lock locks only skip relocking by the owner thread which the
+// recursive mutex does by itself, so they block as well.
+template <typename M, LockStats* S>
+class Mutex : public M {
+  static constexpr bool recursive = is_same<M, recursive_mutex>::value;
+
+ public:
+  void lock() {
+    acquire([this] { return M::try_lock(); }, [this] { M::lock(); });
+  }
+  bool try_lock() {
+    lock();
+    return true;
+  }
+  void lock_shared() {
+    if constexpr (recursive)
+      lock();
+    else
+      acquire([this] { return M::try_lock_shared(); },
+              [this] { M::lock_shared(); });
+  }
+  bool try_lock_shared() {
+    lock_shared();
+    return true;
+  }
+  void unlock_shared() {
+    if constexpr (recursive)
+      M::unlock();
+    else
+      M::unlock_shared();
+  }
+
+ private:
+  template <typename T, typename L>
+  void acquire(T tryLock, L lock) {
+#ifdef TGC_LOCK_STATS
+    S->locks++;
+    if (tryLock())
+      return;
+    auto start = chrono::steady_clock::now();
+    lock();
+    S->contended++;
+    S->waitNs += chrono::duration_cast<chrono::nanoseconds>(
+                     chrono::steady_clock::now() - start)
+                     .count();
+#else
+    (void)tryLock;
+    lock();
+#endif
+  }
+};
+
+#ifdef TGC_LOCK_STATS
+using CollectorMutex = Mutex<recursive_mutex, &collectorLockStats>;
+using ClassMutex = Mutex<shared_mutex, &classLockStats>;
+#else
+using CollectorMutex = Mutex<recursive_mutex, nullptr>;
+using ClassMutex = Mutex<shared_mutex, nullptr>;
+#endif
+
 #endif
 
 class ObjMeta;
 class ClassMeta;
 class PtrBase;
 class IPtrEnumerator;
+struct GcEventInfo;
+
+enum class GcEvent { CycleStart, CycleEnd, PhaseChange, HeapThreshold };
+
+// Calls of the hot paths of the pointer registry, summed over all threads.
+struct GcCounters {
+  uint64_t registerPtr = 0;
+  uint64_t unregisterPtr = 0;
+  // by the state of the collector.
+  uint64_t pointerChanged[3] = {};
+  uint64_t findCreatingObj = 0;
+  // creating objects checked by findCreatingObj.
+  uint64_t creatingObjsScanned = 0;
+  uint64_t globalFindOwnerMeta = 0;
+};
+
+// Totals of the gc heap since the start, maintained as objects are allocated,
+// destructed and freed so reading them is cheap. An array is one object, the
+// bytes include its ObjMeta. A box is one object of the bytes of its cell, the
+// pages of the boxes are not counted, see BoxSlab.
+struct GcStats {
+  uint64_t allocated = 0, allocatedBytes = 0;
+  // by the sweeper, gc_delete or a failing constructor.
+  uint64_t destroyed = 0, destroyedBytes = 0;
+  uint64_t freed = 0;
+  // made permanent so far, they are live until exit.
+  uint64_t permanent = 0;
+
+  // not destructed yet.
+  uint64_t live() const { return allocated - destroyed; }
+  uint64_t liveBytes() const { return allocatedBytes - destroyedBytes; }
+  // destructed by gc_delete, their memory is freed by the sweeper later.
+  uint64_t pendingFree() const { return destroyed - freed; }
+};
+
+// Decisions of gc_collect_auto. It sizes its steps so that a cycle completes
+// before the mutator allocates as many objects as were live when the cycle
+// started, i.e. before the heap doubles.
+struct GcPacerStats {
+  // steps of the marking and of the sweeping of a cycle per object of the
+  // heap, learned from the last cycles.
+  double markStepsPerObject = 2, sweepStepsPerObject = 1;
+  // allocations of the mutator between two calls, learned from the last calls.
+  double allocsPerCall = 0;
+  // steps of the current cycle estimated by the heap size.
+  uint64_t cycleWork = 0;
+  // allocations the current cycle may take, the objects when it started.
+  uint64_t allocBudget = 0;
+  double stepsPerAlloc = 0;
+  // progress of the current cycle.
+  uint64_t cycleAllocs = 0, cycleSteps = 0;
+  // steps of the last call, and the calls that finished a cycle behind.
+  int lastSteps = 0;
+  uint64_t behind = 0;
+};
+
+#ifdef TGC_AGE_STATS
+// Objects of one class swept in a collection cycle by their age, the count of
+// cycles they survived before. The last bucket holds the older ones too.
+struct GcAgeHistogram {
+  static constexpr int MaxAge = 15;
+  const char* className = nullptr;
+  uint64_t survived[MaxAge + 1] = {};
+  uint64_t died[MaxAge + 1] = {};
+};
+#endif
+
+#ifdef TGC_COUNTERS
+// Counters of one thread, only written by it so no atomic read-modify-write
+// is needed, they are summed by gc_counters on demand.
+class ThreadCounters {
+ public:
+  enum Id {
+    RegisterPtr,
+    UnregisterPtr,
+    PointerChanged,
+    FindCreatingObj = PointerChanged + 3,
+    CreatingObjsScanned,
+    GlobalFindOwnerMeta,
+    MaxCnt
+  };
+
+  // never freed, so counting is still safe while the collector is being
+  // destroyed at exit and counters of exited threads are kept.
+  static ThreadCounters& get() {
+    static thread_local auto* inst = new ThreadCounters();
+    return *inst;
+  }
+  void add(int id, uint64_t n = 1) {
+    auto& c = counters[id];
+    c.store(c.load(memory_order_relaxed) + n, memory_order_relaxed);
+  }
+
+  static GcCounters sum();
+  static void reset();
+
+ private:
+  ThreadCounters();
+  void addTo(GcCounters& r) const;
+
+  std::atomic<uint64_t> counters[MaxCnt] = {};
+};
+
+#define TGC_COUNT(id, ...) \
+  ThreadCounters::get().add(ThreadCounters::id, ##__VA_ARGS__)
+#else
+#define TGC_COUNT(id, ...)
+#endif
 
 //////////////////////////////////////////////////////////////////////////
 
 class ObjMeta {
  public:
-  enum class Color : unsigned char { White, Gray, Black };
+  // permanent objects are never marked nor swept, see gc_make_permanent.
+  enum class Color : unsigned char { White, Gray, Black, Permanent };
   using LengthType = unsigned short;
   struct Less {
     bool operator()(ObjMeta* x, ObjMeta* y) const { return *x < *y; }
   };
 
   ClassMeta* klass = nullptr;
+#ifdef TGC_FORK_FRIENDLY
+  // used like atomic<Color>, the color is in the side table at its slot. It's
+  // accessed only with the lock of the collector held.
+  class SideColor {
+   public:
+    unsigned slot = 0;
+    SideColor& operator=(Color c);
+    operator Color() const;
+  } color;
+#else
   atomic<Color> color = Color::White;
+#endif
+#if defined(TGC_AGE_STATS) && !defined(TGC_FORK_FRIENDLY)
+  // collection cycles survived, saturated.
+  unsigned char age = 0;
+#endif
   LengthType arrayLength = 0;
+#ifdef TGC_MULTI_THREADED
+  // not referenced by any pointer yet, see Collector::unpin.
+  atomic<bool> pinned = false;
+#endif
+#ifdef TGC_HEAP_PROFILER
+  // picked by the allocation sampler, it's looked up when freed.
+  bool sampled = false;
+#endif
+  // a page of boxes, its class is a BoxSlab.
+  bool boxPage : 1;
+  // allocated in a gc_permanent_scope still alive, see PermanentScope.
+  bool inScope : 1;
 
   static char* dummyObjPtr;
 
   ObjMeta(ClassMeta* c, char* o, size_t n)
-      : klass(c), arrayLength((LengthType)n) {}
+      : klass(c), arrayLength((LengthType)n), boxPage(false), inScope(false) {}
   ~ObjMeta() {
     if (arrayLength)
       destroy();
@@ -106,6 +382,8 @@ class ObjMeta {
   bool containsPtr(char* p);
   char* objPtr() const;
   void destroy();
+  // the object a pointer refers to, a box is a cell of the page.
+  void destroy(const void* obj);
 };
 
 static_assert(sizeof(ObjMeta) <= sizeof(void*) * 2,
@@ -118,9 +396,19 @@ class IPtrEnumerator {
   virtual ~IPtrEnumerator() {}
   virtual bool hasNext() = 0;
   virtual const PtrBase* getNext() = 0;
+  // also returns the object pointed to, boxes share the meta of their page.
+  virtual ObjMeta* getNextMeta(const void*& obj);
+  // slots are not registered to the collector so never roots, their
+  // enumerators only support getNextMeta.
+  virtual bool isSlotEnumerator() const { return false; }
 
-  void* operator new(size_t sz) {
+  void* operator new([[maybe_unused]] size_t sz) {
+#ifdef TGC_MULTI_THREADED
+    // mutators may enumerate containers while the collector is enumerating.
+    alignas(void*) static thread_local char buf[255];
+#else
     static char buf[255];
+#endif
     assert(sz <= sizeof(buf));
     return buf;
   }
@@ -147,7 +435,7 @@ struct PtrEnumerator : ObjPtrEnumerator {
 class ClassMeta {
  public:
   enum class State : unsigned char { Unregistered, Registered };
-  enum class MemRequest { Alloc, Dctor, Dealloc, NewPtrEnumerator };
+  enum class MemRequest { Alloc, Dctor, Dealloc, NewPtrEnumerator, TypeName };
   using MemHandler = void* (*)(ClassMeta* cls, MemRequest r, void* param);
   using OffsetType = unsigned short;
   using SizeType = unsigned short;
@@ -155,19 +443,26 @@ class ClassMeta {
   MemHandler memHandler = nullptr;
   vector<OffsetType>* subPtrOffsets = nullptr;
   State state = State::Unregistered;
+  // its pointers are just the ones at subPtrOffsets, see ObjPtrEnumerator.
+  bool plainPtrs = false;
   SizeType size = 0;
+#ifdef TGC_AGE_STATS
+  // index of its histogram in the collector, -1 until its objects are swept.
+  int ageStatsIdx = -1;
+#endif
 
 #ifdef TGC_MULTI_THREADED
-  shared_mutex mutex;
+  ClassMutex mutex;
 #else
-  static shared_mutex mutex;
+  static ClassMutex mutex;
 #endif
 
   static atomic<int> isCreatingObj;
   static ClassMeta dummy;
 
   ClassMeta() {}
-  ClassMeta(MemHandler h, SizeType sz) : memHandler(h), size(sz) {}
+  ClassMeta(MemHandler h, SizeType sz, bool plain = false)
+      : memHandler(h), plainPtrs(plain), size(sz) {}
   ~ClassMeta() { delete subPtrOffsets; }
 
   ObjMeta* newMeta(size_t objCnt);
@@ -176,6 +471,10 @@ class ClassMeta {
   IPtrEnumerator* enumPtrs(ObjMeta* m) {
     return (IPtrEnumerator*)memHandler(this, MemRequest::NewPtrEnumerator, m);
   }
+  // mangled by some compilers.
+  const char* typeName() {
+    return (const char*)memHandler(this, MemRequest::TypeName, nullptr);
+  }
 
   template <typename T>
   static ClassMeta* get() {
@@ -183,17 +482,67 @@ class ClassMeta {
   }
 
  private:
+  // Freed memory blocks of one class, linked through the first word of the
+  // object storage.
+  struct FreeList {
+    char* head = nullptr;
+    size_t cnt = 0;
+
+    ~FreeList() {
+      while (auto* p = pop())
+        delete[] p;
+    }
+    void push(char* p) {
+      *(char**)(p + sizeof(ObjMeta)) = head;
+      head = p;
+      cnt++;
+    }
+    char* pop() {
+      auto* p = head;
+      if (p) {
+        head = *(char**)(p + sizeof(ObjMeta));
+        cnt--;
+      }
+      return p;
+    }
+  };
+
+  // Max count of freed objects of T kept for reuse, classes opt in by
+  // defining a static tgcPoolSize member.
+  template <typename T, typename = void>
+  struct PoolSize {
+    static constexpr size_t value = 0;
+  };
+  template <typename T>
+  struct PoolSize<T, void_t<decltype(T::tgcPoolSize)>> {
+    static_assert(sizeof(T) >= sizeof(char*), "too small to be pooled");
+    static constexpr size_t value = T::tgcPoolSize;
+  };
+
   template <typename T>
   struct Holder {
     static void* MemHandler(ClassMeta* cls, MemRequest r, void* param) {
       switch (r) {
         case MemRequest::Alloc: {
           auto cnt = (size_t)param;
+          if constexpr (PoolSize<T>::value > 0) {
+            assert(cnt == 1 && "pooled objects can not be allocated as array");
+            unique_lock lk{cls->mutex};
+            if (auto* p = freeList.pop())
+              return new (p) ObjMeta(cls, p + sizeof(ObjMeta), cnt);
+          }
           auto* p = new char[cls->size * cnt + sizeof(ObjMeta)];
           return new (p) ObjMeta(cls, p + sizeof(ObjMeta), cnt);
         }
         case MemRequest::Dealloc: {
           auto meta = (ObjMeta*)param;
+          if constexpr (PoolSize<T>::value > 0) {
+            unique_lock lk{cls->mutex};
+            if (freeList.cnt < PoolSize<T>::value) {
+              freeList.push((char*)meta);
+              break;
+            }
+          }
           delete[](char*) meta;
         } break;
         case MemRequest::Dctor: {
@@ -207,16 +556,23 @@ class ClassMeta {
           auto meta = (ObjMeta*)param;
           return new PtrEnumerator<T>(meta);
         } break;
+        case MemRequest::TypeName:
+          return (void*)typeid(T).name();
       }
       return nullptr;
     }
 
     static ClassMeta inst;
+    static FreeList freeList;
   };
 };
 
 template <typename T>
-ClassMeta ClassMeta::Holder<T>::inst{MemHandler, sizeof(T)};
+ClassMeta ClassMeta::Holder<T>::inst{
+    MemHandler, sizeof(T), is_base_of_v<ObjPtrEnumerator, PtrEnumerator<T>>};
+
+template <typename T>
+ClassMeta::FreeList ClassMeta::Holder<T>::freeList;
 
 #ifndef TGC_MULTI_THREADED
 static_assert(sizeof(ClassMeta) <= sizeof(void*) * 3,
@@ -225,23 +581,98 @@ static_assert(sizeof(ClassMeta) <= sizeof(void*) * 3,
 
 //////////////////////////////////////////////////////////////////////////
 
+// Set for the types of the auto-boxes by TGC_DECL_AUTO_BOX.
+template <typename T>
+struct IsAutoBox : false_type {};
+
+// The class of the pages holding the boxes of one auto-box type, which are
+// small, pointer-free and numerous. A page is one object to the collector and
+// its header keeps the cells in bitmaps, allocated, constructed, pinned and
+// marked, so a box has no ObjMeta, no node in metaSet and no malloc header of
+// its own. Pages are aligned to their size so a cell finds its page by masking
+// its address, and a page is released once a sweep leaves it empty.
+class BoxSlab : public ClassMeta {
+ public:
+  static constexpr size_t PageSize = 64 * 1024;
+
+  BoxSlab(size_t cellSize, void (*dctor)(void*), const char* cellTypeName)
+      : ClassMeta(PageHandler, PageSize - sizeof(ObjMeta), true),
+        cellSize(cellSize),
+        dctor(dctor),
+        cellTypeName(cellTypeName) {}
+  template <typename T>
+  static constexpr size_t cellSizeOf() {
+    static_assert(alignof(T) <= 64 && sizeof(T) <= 1024,
+                  "too large for a box page");
+    constexpr size_t align = alignof(T);
+    // freed cells are linked through their first word.
+    return (max(sizeof(T), sizeof(void*)) + align - 1) / align * align;
+  }
+
+  // the cell is pinned until unpinned, see Collector::unpin.
+  char* alloc(ObjMeta*& page);
+  static void unpin(const void* cell);
+  // a cell whose constructor threw.
+  static void free(const void* cell);
+  static void destroy(const void* cell);
+
+  // with the lock of the collector held.
+  static void mark(const void* cell);
+  static void clearMarks(ObjMeta* page);
+#ifdef TGC_FORK_FRIENDLY
+  // moves the mark bits of the page to the current mark table.
+  static void renewMarks(ObjMeta* page);
+#endif
+  // frees the cells neither marked nor pinned, returns the cells visited.
+  static int sweep(ObjMeta* page);
+  // empty and not the last page with free cells, kept for the next boxes.
+  static bool isSpare(ObjMeta* page);
+
+ private:
+  struct Page;
+
+  static void* PageHandler(ClassMeta* cls, MemRequest r, void* param);
+
+  size_t cellSize;
+  void (*dctor)(void*);
+  const char* cellTypeName;
+  // pages with free cells.
+  Page* partial = nullptr;
+};
+
+template <typename T>
+inline BoxSlab boxSlab{BoxSlab::cellSizeOf<T>(),
+                       [](void* p) { ((T*)p)->~T(); }, typeid(T).name()};
+
+//////////////////////////////////////////////////////////////////////////
+
 class PtrBase {
   friend class Collector;
   friend class ClassMeta;
+  friend class IPtrEnumerator;
+  template <typename T>
+  friend class gc_function;
 
  public:
-  ObjMeta* getMeta() { return meta; }
+  ObjMeta* getMeta() const { return meta; }
 
  protected:
   PtrBase();
   PtrBase(void* obj);
   ~PtrBase();
   void onPtrChanged();
+#ifdef TGC_MULTI_THREADED
+  void onPtrAdopted();
+#endif
 
  protected:
   ObjMeta* meta = nullptr;
-  mutable unsigned int isRoot : 1;
-  unsigned int index : 31;
+  // not sharing a word with index, which other threads rewrite when they move
+  // this pointer.
+  mutable bool isRoot;
+  unsigned int index;
+  // the pointee, which the collector needs for a box.
+  void* ptr = nullptr;
 };
 
 template <typename T>
@@ -257,15 +688,21 @@ class GcPtr : public PtrBase {
   // Constructors
 
   GcPtr() {}
-  GcPtr(ObjMeta* meta) { reset((T*)meta->objPtr(), meta); }
-  explicit GcPtr(T* obj) : PtrBase(obj), p(obj) {}
+  GcPtr(ObjMeta* meta) {
+    reset((T*)meta->objPtr(), meta);
+#ifdef TGC_MULTI_THREADED
+    if (meta->pinned)
+      onPtrAdopted();
+#endif
+  }
+  explicit GcPtr(T* obj) : PtrBase((void*)obj) {}
   template <typename U>
   GcPtr(const GcPtr<U>& r) {
-    reset(static_cast<T*>(r.p), r.meta);
+    reset(static_cast<T*>(r.get()), r.meta);
   }
-  GcPtr(const GcPtr& r) { reset(r.p, r.meta); }
+  GcPtr(const GcPtr& r) { reset(r.get(), r.meta); }
   GcPtr(GcPtr&& r) {
-    reset(r.p, r.meta);
+    reset(r.get(), r.meta);
     r = nullptr;
   }
 
@@ -273,42 +710,45 @@ class GcPtr : public PtrBase {
 
   template <typename U>
   GcPtr& operator=(const GcPtr<U>& r) {
-    reset(r.p, r.meta);
+    reset(r.get(), r.meta);
     return *this;
   }
   GcPtr& operator=(const GcPtr& r) {
-    reset(r.p, r.meta);
+    reset(r.get(), r.meta);
     return *this;
   }
   GcPtr& operator=(GcPtr&& r) {
-    reset(r.p, r.meta);
+    reset(r.get(), r.meta);
     r.meta = 0;
-    r.p = 0;
+    r.ptr = 0;
     return *this;
   }
-  T* operator->() const { return p; }
-  T& operator*() const { return *p; }
-  explicit operator bool() const { return p && meta; }
-  bool operator==(const GcPtr& r) const { return p == r.p; }
-  bool operator!=(const GcPtr& r) const { return p != r.p; }
+  T* operator->() const { return get(); }
+  T& operator*() const { return *get(); }
+  explicit operator bool() const { return ptr && meta; }
+  bool operator==(const GcPtr& r) const { return ptr == r.ptr; }
+  bool operator!=(const GcPtr& r) const { return ptr != r.ptr; }
   GcPtr& operator=(T* ptr) = delete;
   GcPtr& operator=(nullptr_t) {
     meta = 0;
-    p = 0;
+    ptr = 0;
     return *this;
   }
-  bool operator<(const GcPtr& r) const { return *p < *r.p; }
+  // by identity as std::shared_ptr, compare the pointees for their values.
+  bool operator<(const GcPtr& r) const {
+    return std::less<T*>{}(get(), r.get());
+  }
 
   // Methods
 
   void reset(T* o, ObjMeta* n) {
-    p = o;
+    ptr = (void*)o;
     meta = n;
     onPtrChanged();
   }
 
  protected:
-  T* p = nullptr;
+  T* get() const { return (T*)ptr; }
 };
 
 static_assert(sizeof(GcPtr<int>) <= sizeof(void*) * 3);
@@ -326,11 +766,13 @@ class gc : public GcPtr<T> {
 };
 
 #define TGC_DECL_AUTO_BOX(T, GcAliasName)                    \
+  template <>                                                \
+  struct details::IsAutoBox<T> : std::true_type {};          \
   template <>                                                \
   class details::gc<T> : public details::GcPtr<T> {          \
    public:                                                   \
     using GcPtr<T>::GcPtr;                                   \
-    gc(const T& i) : GcPtr(details::gc_new_meta<T>(1, i)) {} \
+    gc(const T& i) { details::newBox(*this, i); }            \
     gc() {}                                                  \
     gc(nullptr_t) {}                                         \
     operator T&() { return operator*(); }                    \
@@ -340,28 +782,103 @@ class gc : public GcPtr<T> {
 
 //////////////////////////////////////////////////////////////////////////
 
+// The gc_permanent_scope of a thread, the outermost one collects the objects
+// the thread allocates until it ends.
+struct PermanentScope {
+  int depth = 0;
+  set<ObjMeta*> allocs;
+};
+
+#ifdef TGC_MULTI_THREADED
+inline thread_local PermanentScope* threadScope = nullptr;
+#else
+inline PermanentScope* threadScope = nullptr;
+#endif
+
 class Collector {
   friend class ClassMeta;
+  friend class ObjMeta;
   friend class PtrBase;
+  friend class BoxSlab;
 
  public:
   static Collector* get();
   void onPointerChanged(PtrBase* p);
   void registerPtr(PtrBase* p);
   void unregisterPtr(PtrBase* p);
+  // unregister all pointers of a container under one lock, their destructors
+  // won't touch the registry anymore.
+  void unregisterPtrs(IPtrEnumerator* it);
+#ifdef TGC_MULTI_THREADED
+  // new objects are pinned until the first gc pointer refers to them, so
+  // they are not collected while being handed over to another thread.
+  void unpin(ObjMeta* meta);
+#endif
+  void onSlotChanged(ObjMeta* meta, const void* obj);
   ObjMeta* globalFindOwnerMeta(void* obj);
+  void releaseMeta(ObjMeta* meta);
   void collect(int stepCnt);
+  void collectFull();
+  void prepareFork();
+#ifdef TGC_MULTI_THREADED
+  void setMarkThreads(unsigned n);
+#endif
+  void makePermanent(ObjMeta* root);
+  void beginPermanentScope();
+  void endPermanentScope();
+  void collectAuto();
+  GcPacerStats pacerStats();
+  bool idle(chrono::steady_clock::time_point deadline);
+  uint64_t cycles() const { return cycleCnt; }
+  static GcStats stats();
   void dumpStats();
+#ifdef TGC_AGE_STATS
+  vector<GcAgeHistogram> ageStats();
+#endif
+  // true while garbage objects are being destructed, their pointees may be
+  // already freed.
+  bool isSweeping() const { return sweeping; }
 
   enum class State { RootMarking, LeafMarking, Sweeping, MaxCnt };
+  static constexpr unsigned DetachedIdx = (1u << 31) - 1;
+  // of the locals of coroutine frames, which are not in the registry either.
+  static constexpr unsigned FrameIdx = DetachedIdx - 1;
+  // smaller heaps are marked by one thread, see gc_set_mark_threads.
+  static constexpr size_t ParallelMarkMinObjs = 1 << 16;
 
  private:
   Collector();
   ~Collector();
 
   void tryMarkRoot(PtrBase* p);
+  void markGray(ObjMeta* meta, const void* obj);
+  void delayToNextCycle(ObjMeta* meta, const void* obj);
   ObjMeta* findCreatingObj(PtrBase* p);
   void addMeta(ObjMeta* meta);
+  // returns the steps left, stops at the end of the phase if onePhase.
+  int collectSteps(int stepCnt, bool onePhase = false);
+  // marks everything reachable at once, returns the steps it took.
+  uint64_t markFull();
+  // calls mark with each pointer of a black object, returns the pointers.
+  template <typename F>
+  static uint64_t tracePtrs(ObjMeta* o, F&& mark);
+#if defined(TGC_MULTI_THREADED) && !defined(TGC_FORK_FRIENDLY)
+  uint64_t markParallel(unsigned workers);
+#endif
+  // takes the object out of the collection, e.g. before freeing it. A gray
+  // one is left on the gray stack, popping skips what isn't gray anymore.
+  void removeMeta(ObjMeta* meta);
+  // with the lock held.
+  void makePermanentLocked(ObjMeta* root);
+  // traces the remembered set from nextRemembered, returns whether it's done.
+  bool markRemembered(int& stepCnt);
+  // with the lock held.
+  void forgetScopeAlloc(ObjMeta* meta);
+  void queueEvent(GcEvent event);
+  void checkHeapThresholds();
+#ifdef TGC_AGE_STATS
+  void recordAge(ObjMeta* meta, bool died);
+#endif
 
  private:
   using MetaSet = set<ObjMeta*, ObjMeta::Less>;
@@ -371,10 +888,54 @@ class Collector {
   MetaSet metaSet;
   // stack is no feasible for multi-threaded version.
   list<ObjMeta*> creatingObjs;
+#ifdef TGC_MULTI_THREADED
+  unordered_set<ObjMeta*> pinnedObjs;
+  // Sweeping waits for objects under construction, as they can't be traced,
+  // for this many collection calls at most. The root marking is then run
+  // again with every pointer as a root, like markFull does, and the objects
+  // unpinned after are kept.
+  static constexpr int MaxCreatingWaits = 4;
+  int creatingWaits = 0;
+  bool creatingMarked = false;
+#endif
   MetaSet::iterator nextSweeping;
+  // out of metaSet, so the sweeping doesn't visit them.
+  MetaSet permanentSet;
+  // The remembered set of the permanent objects: their registered pointers
+  // are roots, and the ones with slots, which have no root flag, are listed
+  // here to be traced at every cycle.
+  // Released ones are cleared, they're dropped when a pass starts.
+  vector<ObjMeta*> rememberedObjs;
+  // of the remembered set, traced at the end of the root marking.
+  size_t nextRemembered = 0;
+  // The scopes of the threads with a gc_permanent_scope alive, and their
+  // allocations not freed yet, flagged inScope.
+  list<PermanentScope*> permanentScopes;
   size_t nextRootMarking = 0;
   State state = State::RootMarking;
-  shared_mutex mutex;
+  atomic<bool> sweeping = false;
+  bool inCycle = false;
+  uint64_t cycleCnt = 0;
+  // estimated by idle, by state.
+  double stepCostNs[(int)State::MaxCnt] = {100, 100, 100};
+  // steps ever run, and the steps and allocations when the cycle started.
+  uint64_t stepsDone = 0, cycleStartSteps = 0, cycleStartAllocs = 0;
+  // steps ever run when the sweeping of the cycle started.
+  uint64_t sweepStartSteps = 0;
+  uint64_t cycleStartObjs = 0;
+  GcPacerStats pacer;
+#ifdef TGC_MULTI_THREADED
+  unsigned markThreads = 1;
+#endif
+  uint64_t lastAutoAllocs = 0;
+  bool autoStarted = false;
+  // fired by collect after unlocking.
+  vector<GcEventInfo> pendingEvents;
+  CollectorMutex mutex;
+#ifdef TGC_AGE_STATS
+  // by ClassMeta::ageStatsIdx, of the current and the last completed cycle.
+  vector<GcAgeHistogram> sweepingAges, lastCycleAges;
+#endif
 
   static Collector* inst;
 };
@@ -383,10 +944,153 @@ inline void gc_collect(int steps = 256) {
   Collector::get()->collect(steps);
 }
 
+// Collects all garbage before returning, e.g. before forking or taking a
+// heap snapshot. Unlike gc_collect(INT_MAX) it marks in one go, without the
+// write barriers and the per step bookkeeping, then sweeps. An unfinished
+// incremental cycle is finished by the full marking rather than restarted.
+// With TGC_MULTI_THREADED, large heaps may be marked by several threads, see
+// gc_set_mark_threads.
+inline void gc_collect_full() {
+  Collector::get()->collectFull();
+}
+
+#ifdef TGC_MULTI_THREADED
+// Threads marking in gc_collect_full, 1 by default. Heaps of at least
+// Collector::ParallelMarkMinObjs objects have their objects traced by that
+// many threads while the mutators wait, as for the serial marking. Not used
+// with TGC_FORK_FRIENDLY, whose colors are not atomic.
+inline void gc_set_mark_threads(unsigned n) {
+  Collector::get()->setMarkThreads(n);
+}
+#endif
+
+// Readies the heap to be shared by forked children: collects all garbage,
+// returns the freed memory to the system where the allocator can and, with
+// TGC_FORK_FRIENDLY, renumbers the color slots of the live objects to be
+// dense. The objects stay where they are, but a child collecting then only
+// reads their pages, except the ones of its garbage.
+inline void gc_prepare_fork() {
+  Collector::get()->prepareFork();
+}
+
+// Makes the object and everything reachable from it permanent, e.g. data
+// loaded at startup and never freed. Cycles neither trace nor sweep them, but
+// the pointers they hold into the rest of the heap are treated as roots. The
+// objects are only freed at exit, or by a gc_delete after which their memory
+// stays reserved. Objects being constructed are left as they are.
+template <typename T>
+void gc_make_permanent(const GcPtr<T>& root) {
+  Collector::get()->makePermanent(root.getMeta());
+}
+
+// Objects the thread allocates while a scope is alive are made permanent when
+// its outermost one ends, if they are still reachable then. It runs a
+// gc_collect_full first to free the temporaries of the scope. Allocations of
+// other threads are left as they are.
+class gc_permanent_scope {
+ public:
+  gc_permanent_scope() { Collector::get()->beginPermanentScope(); }
+  ~gc_permanent_scope() { Collector::get()->endPermanentScope(); }
+  gc_permanent_scope(const gc_permanent_scope&) = delete;
+  gc_permanent_scope& operator=(const gc_permanent_scope&) = delete;
+};
+
+// gc_collect with steps proportional to the objects allocated since the last
+// call, see GcPacerStats. Busy mutators get more steps, quiet ones a few.
+inline void gc_collect_auto() {
+  Collector::get()->collectAuto();
+}
+
+inline GcPacerStats gc_pacer_stats() {
+  return Collector::get()->pacerStats();
+}
+
+// Collects while the caller is idle: runs units of work that fit before the
+// deadline, each within one phase of the collector, e.g. the rest of the
+// marking or a part of the sweeping. They are sized by the cost per step of
+// each phase measured by earlier calls. Finishing a cycle frees the buffer of
+// the marking and returns true, the caller may stop notifying until it was
+// busy again.
+inline bool gc_idle_notification(chrono::steady_clock::time_point deadline) {
+  return Collector::get()->idle(deadline);
+}
+
+using GcState = Collector::State;
+
+struct GcEventInfo {
+  GcEvent event;
+  // the state entered by PhaseChange.
+  GcState state;
+  // count of the cycles started so far.
+  uint64_t cycle = 0;
+  // the live bytes crossed by HeapThreshold.
+  uint64_t threshold = 0;
+  GcStats stats;
+};
+
+// Listeners are called without any lock of the collector held, so they may
+// allocate or collect. Events of a gc_collect call are delivered when it's
+// about to return, HeapThreshold when the allocation crossing it returns, or
+// with the events of the collection if a destructor it runs allocated.
+using GcEventListener = function<void(const GcEventInfo&)>;
+
+// returns an id for gc_remove_event_listener.
+int gc_add_event_listener(GcEventListener listener);
+void gc_remove_event_listener(int id);
+// HeapThreshold is fired once the live bytes rise above one of them, and
+// again after they fell below it at the end of a cycle.
+void gc_set_heap_thresholds(vector<uint64_t> liveBytes);
+
+// safe to call at high frequency, no lock is taken.
+inline GcStats gc_stats() {
+  return Collector::stats();
+}
+
 inline void gc_dumpStats() {
   Collector::get()->dumpStats();
 }
 
+#ifdef TGC_COUNTERS
+inline GcCounters gc_counters() {
+  return ThreadCounters::sum();
+}
+inline void gc_reset_counters() {
+  ThreadCounters::reset();
+}
+#endif
+
+#ifdef TGC_AGE_STATS
+// histograms of the classes with objects swept in the last completed cycle,
+// e.g. a survival rate per age tells how large a nursery should be.
+inline vector<GcAgeHistogram> gc_age_stats() {
+  return Collector::get()->ageStats();
+}
+#endif
+
+#ifdef TGC_HEAP_PROFILER
+// Samples allocations with their call stacks, one every meanBytes allocated
+// bytes on average. The intervals between samples are exponentially
+// distributed like tcmalloc does, so every byte has the same chance to be
+// picked whatever the sizes and the order of the allocations are. Sampled
+// objects are tracked until they are freed, boxes by their cells rather than
+// their pages. Restarting drops the samples.
+void gc_heap_profiler_start(size_t meanBytes = 512 * 1024);
+void gc_heap_profiler_stop();
+// writes the samples aggregated by call stack in the legacy heap profile
+// format of gperftools, which pprof reads and scales by the sampling rate.
+// false if the file can't be written.
+bool gc_heap_profiler_dump(const char* path);
+#endif
+
+#if defined(TGC_MULTI_THREADED) && defined(TGC_LOCK_STATS)
+inline LockStats& gc_collector_lock_stats() {
+  return collectorLockStats;
+}
+inline LockStats& gc_class_lock_stats() {
+  return classLockStats;
+}
+#endif
+
 template <typename T, typename... Args>
 ObjMeta* gc_new_meta(size_t len, Args&&... args) {
   auto* cls = ClassMeta::get<T>();
@@ -409,14 +1113,37 @@ ObjMeta* gc_new_meta(size_t len, Args&&... args) {
   return meta;
 }
 
+// Constructs a box in a cell of a page of its type, see BoxSlab.
+template <typename T, typename... Args>
+void newBox(GcPtr<T>& r, Args&&... args) {
+  ObjMeta* page;
+  auto* cell = boxSlab<T>.alloc(page);
+  try {
+    new (cell) T(forward<Args>(args)...);
+  } catch (...) {
+    BoxSlab::free(cell);
+    throw;
+  }
+  r.reset((T*)cell, page);
+  BoxSlab::unpin(cell);
+}
+
 template <typename T>
 void gc_delete(gc<T>& c) {
   if (c) {
-    c.getMeta()->destroy();
+    c.getMeta()->destroy(c.operator->());
     c = nullptr;
   }
 }
 
+// Destroys the object of a container element about to be cleared, without
+// the barrier of resetting the pointer.
+template <typename P>
+void destroyElement(const P& p) {
+  if (auto* meta = p.getMeta())
+    meta->destroy(p.operator->());
+}
+
 // used as shared_from_this
 template <typename T>
 gc<T> gc_from(T* o) {
@@ -439,7 +1166,13 @@ gc<To> gc_dynamic_pointer_cast(gc<From>& from) {
 
 template <typename T, typename... Args>
 gc<T> gc_new(Args&&... args) {
-  return gc_new_meta<T>(1, forward<Args>(args)...);
+  if constexpr (IsAutoBox<T>::value) {
+    gc<T> r;
+    newBox(r, forward<Args>(args)...);
+    return r;
+  } else {
+    return gc_new_meta<T>(1, forward<Args>(args)...);
+  }
 }
 
 template <typename T, typename... Args>
@@ -453,76 +1186,641 @@ gc<T> gc_new_array(size_t len, Args&&... args) {
 template <typename T>
 class gc_function;
 
+template <size_t N>
+struct GcFunctionBuf {
+  alignas(void*) mutable char buf[N];
+};
+
+template <>
+struct GcFunctionBuf<0> {};
+
 template <typename R, typename... A>
-class gc_function<R(A...)> {
+class gc_function<R(A...)> : GcFunctionBuf<TGC_FUNCTION_INLINE_SIZE> {
  public:
   gc_function() {}
+  gc_function(nullptr_t) {}
+  gc_function(const gc_function& r) { copyFrom(r); }
+  gc_function(gc_function&& r) { moveFrom(r); }
+
+  template <typename F,
+            typename = enable_if_t<!is_same<decay_t<F>, gc_function>::value>>
+  gc_function(F&& f) {
+    assign<decay_t<F>>(forward<F>(f));
+  }
 
-  template <typename F>
-  gc_function(F&& f) : callable(gc_new_meta<Imp<F>>(1, forward<F>(f))) {}
+  ~gc_function() { reset(); }
 
-  template <typename F>
+  gc_function& operator=(const gc_function& r) {
+    if (this != &r) {
+      reset();
+      copyFrom(r);
+    }
+    return *this;
+  }
+  gc_function& operator=(gc_function&& r) {
+    if (this != &r) {
+      reset();
+      moveFrom(r);
+    }
+    return *this;
+  }
+  gc_function& operator=(nullptr_t) {
+    reset();
+    return *this;
+  }
+
+  // the previous target is released before the new one is constructed.
+  template <typename F,
+            typename = enable_if_t<!is_same<decay_t<F>, gc_function>::value>>
   gc_function& operator=(F&& f) {
-    callable = gc_new_meta<Imp<F>>(1, forward<F>(f));
+    reset();
+    assign<decay_t<F>>(forward<F>(f));
     return *this;
   }
 
-  template <typename... U>
-  R operator()(U&&... a) const {
-    return callable->call(forward<U>(a)...);
+  template <typename... Args>
+  R operator()(Args&&... a) const {
+    CallScope scope{this};
+    return scope.c->call(arg<A>(forward<Args>(a))...);
   }
 
-  explicit operator bool() const { return (bool)callable; }
-  bool operator==(const gc_function& r) const { return callable == r.callable; }
-  bool operator!=(const gc_function& r) const { return callable != r.callable; }
+  explicit operator bool() const { return inlTarget() || callable; }
+  bool operator==(const gc_function& r) const { return target() == r.target(); }
+  bool operator!=(const gc_function& r) const { return target() != r.target(); }
 
  private:
   struct Callable {
+    // heap target referenced by more than one function, which other threads
+    // may be copying and calling.
+    atomic<bool> shared = false;
+    // inline closure reset while running, destroyed when its call returns.
+    bool released = false;
+    atomic<unsigned short> callDepth = 0;
+
     virtual ~Callable() {}
-    virtual R call(A... a) = 0;
+    virtual R call(A&&... a) = 0;
+    // clones the closure into dst.
+    virtual void copyTo(gc_function& dst) const = 0;
+    virtual void moveTo(gc_function& dst) = 0;
+  };
+
+  // An argument binding a parameter of call is passed by reference all the
+  // way to the closure. Others are converted to a temporary as passing them
+  // by value would.
+  template <typename P, typename U>
+  using BindsParam =
+      bool_constant<is_reference<P>::value || is_same<U, P>::value>;
+
+  template <typename P, typename U,
+            enable_if_t<BindsParam<P, U>::value, int> = 0>
+  static U&& arg(U&& u) {
+    return forward<U>(u);
+  }
+  template <typename P, typename U,
+            enable_if_t<!BindsParam<P, U>::value, int> = 0>
+  static P arg(U&& u) {
+    return forward<U>(u);
+  }
+
+  struct CallScope {
+    const gc_function* f;
+    Callable* c;
+    CallScope(const gc_function* ff) : f(ff), c(ff->target()) {
+      c->callDepth++;
+    }
+    ~CallScope() {
+      if (!--c->callDepth && c->released)
+        f->destroyInline();
+    }
   };
 
   template <typename F>
   struct Imp : Callable {
+    static constexpr size_t tgcPoolSize = TGC_FUNCTION_POOL_SIZE;
     F f;
-    Imp(F&& ff) : f(ff) {}
-    R call(A... a) override { return f(a...); }
+    template <typename U>
+    Imp(U&& ff) : f(forward<U>(ff)) {}
+    R call(A&&... a) override { return f(forward<A>(a)...); }
+    void copyTo(gc_function& dst) const override {
+      if constexpr (is_copy_constructible<F>::value)
+        dst.assign<F>(f);
+    }
+    void moveTo(gc_function& dst) override { dst.assign<F>(move(f)); }
   };
 
+  // Small closures are stored inline when this function is a root, their gc
+  // pointers are then registered as roots and traced in place. Inside a gc
+  // object the closure always goes to the gc heap so it is traced as a child.
+  // Move-only closures also go to the heap, where copies share the target, and
+  // so do the ones assigned while a released inline closure still runs.
+  template <typename F, typename U>
+  void assign(U&& f) {
+    using I = Imp<F>;
+    if constexpr (sizeof(I) <= TGC_FUNCTION_INLINE_SIZE &&
+                  alignof(I) <= alignof(void*) &&
+                  is_copy_constructible<F>::value) {
+      if (callable.isRoot && !inl) {
+        inl = new (this->buf) I(forward<U>(f));
+        return;
+      }
+    }
+    callable = gc_new_meta<I>(1, forward<U>(f));
+  }
+
+  // Copies of a heap target share it, so they compare equal and see the state
+  // of a mutable closure changed by each other. An inline closure is cloned
+  // into the copy, the source is only read as other threads may copy it too.
+  void copyFrom(const gc_function& r) {
+    if (auto* i = r.inlTarget()) {
+      i->copyTo(*this);
+    } else if (r.callable) {
+      r.callable->shared = true;
+      callable = r.callable;
+    }
+  }
+
+  // a running inline closure is copied, its source is released on return.
+  void moveFrom(gc_function& r) {
+    if (auto* i = r.inlTarget()) {
+      if (i->callDepth)
+        i->copyTo(*this);
+      else
+        i->moveTo(*this);
+      r.reset();
+    } else {
+      callable = move(r.callable);
+    }
+  }
+
+  // A heap target never shared and not running is garbage once released,
+  // recycle it into the pool of its class without waiting for a collection.
+  // A running inline closure is destroyed once its outermost call returns.
+  void reset() {
+    if (auto* i = inlTarget()) {
+      if (i->callDepth)
+        i->released = true;
+      else
+        destroyInline();
+    } else if (callable) {
+      auto* c = Collector::get();
+      if (!c->isSweeping() && !callable->shared && !callable->callDepth) {
+        auto* meta = callable.getMeta();
+        callable = nullptr;
+        c->releaseMeta(meta);
+      } else {
+        callable = nullptr;
+      }
+    }
+  }
+
+  void destroyInline() const {
+    inl->~Callable();
+    inl = nullptr;
+  }
+
+  Callable* inlTarget() const { return inl && !inl->released ? inl : nullptr; }
+  Callable* target() const {
+    auto* i = inlTarget();
+    return i ? i : callable.operator->();
+  }
+
  private:
   gc<Callable> callable;
+  // mutable, a released inline closure is destroyed when its call returns.
+  mutable Callable* inl = nullptr;
 };
 
 //////////////////////////////////////////////////////////////////////////
-// Wrap STL Containers
-//////////////////////////////////////////////////////////////////////////
+/// Coroutine
+/// frames of gc_task coroutines are allocated from the gc heap and traced as
+/// one object, gc pointers living in a frame are its children. A suspended
+/// task is only kept alive by the gc_task objects referencing it, resumers
+/// holding raw coroutine handles must keep the task reachable as well.
+
+// Gc pointers of a gc_task frame, it has no fixed layout. The ones registered
+// while the frame is the runningFrame of the thread are recorded here instead
+// of the pointer registry, which is from its allocation until it suspends and
+// again whenever it's resumed, and dropped as they are unregistered, which
+// also happens while it runs or is being destroyed. Their changes shade the
+// new pointees as for slots. Defined whether coroutines are supported or not,
+// the library may be built without them.
+struct FramePtrs {
+  char *begin = nullptr, *end = nullptr;
+  // sorted, of the pointers alive in the frame.
+  vector<unsigned> offsets;
+  // the running frame when this one was resumed.
+  FramePtrs* resumer = nullptr;
+  // by the collector or by operator delete of a frame failing to start.
+  bool destroyed = false;
+
+  bool contains(const void* p) const {
+    return begin <= (const char*)p && (const char*)p < end;
+  }
+  // with the lock of the collector held.
+  void add(const PtrBase* p);
+  void remove(const PtrBase* p);
+  void resumed();
+  void suspended();
+};
 
-template <typename C>
-struct ContainerPtrEnumerator : IPtrEnumerator {
-  C* o;
-  typename C::iterator it;
-  ContainerPtrEnumerator(ObjMeta* m) : o((C*)m->objPtr()), it(o->begin()) {}
-  bool hasNext() override { return it != o->end(); }
+#ifdef TGC_MULTI_THREADED
+inline thread_local FramePtrs* runningFrame = nullptr;
+#else
+inline FramePtrs* runningFrame = nullptr;
+#endif
+
+#ifdef __cpp_impl_coroutine
+
+template <typename T = void>
+class gc_task;
+
+struct CoroChunk {
+  alignas(__STDCPP_DEFAULT_NEW_ALIGNMENT__) char
+      data[__STDCPP_DEFAULT_NEW_ALIGNMENT__];
 };
 
-//////////////////////////////////////////////////////////////////////////
-/// Vector
-/// vector elements are not stored contiguously due to implementation
-/// limitation. use gc_new_array for better performance.
+// frames have no fixed layout, their pointers are the ones alive recorded in
+// FramePtrs.
+class FramePtrEnumerator : public IPtrEnumerator {
+  FramePtrs* ptrs;
+  size_t idx = 0;
 
-template <typename T>
-class gc_vector : public gc<vector<gc<T>>> {
  public:
-  using gc<vector<gc<T>>>::gc;
-  gc<T>& operator[](int idx) { return (*this->p)[idx]; }
+  FramePtrEnumerator(ObjMeta* m) : ptrs((FramePtrs*)m->objPtr()) {}
+  bool hasNext() override { return idx < ptrs->offsets.size(); }
+  const PtrBase* getNext() override {
+    return (const PtrBase*)(ptrs->begin + ptrs->offsets[idx++]);
+  }
 };
 
-template <typename T>
-struct PtrEnumerator<vector<gc<T>>> : ContainerPtrEnumerator<vector<gc<T>>> {
-  using ContainerPtrEnumerator<vector<gc<T>>>::ContainerPtrEnumerator;
+// A frame is allocated after its FramePtrs, their ObjMeta is the one of both.
+template <typename P>
+struct CoroFrameClass {
+  static constexpr size_t HeaderSize =
+      (sizeof(FramePtrs) + sizeof(CoroChunk) - 1) / sizeof(CoroChunk) *
+      sizeof(CoroChunk);
 
-  const PtrBase* getNext() override { return &*this->it++; }
-};
+  static FramePtrs* ptrsOf(void* frame) {
+    return (FramePtrs*)((char*)frame - HeaderSize);
+  }
+  static ObjMeta* metaOf(void* frame) {
+    return (ObjMeta*)((char*)ptrsOf(frame) - sizeof(ObjMeta));
+  }
+
+  static void* MemHandler(ClassMeta* cls, ClassMeta::MemRequest r, void* param) {
+    switch (r) {
+      case ClassMeta::MemRequest::Alloc: {
+        auto cnt = (size_t)param;
+        auto* p = new char[cls->size * cnt + sizeof(ObjMeta)];
+        return new (p) ObjMeta(cls, p + sizeof(ObjMeta), cnt);
+      }
+      case ClassMeta::MemRequest::Dealloc: {
+        delete[](char*) param;
+      } break;
+      case ClassMeta::MemRequest::Dctor: {
+        auto* ptrs = (FramePtrs*)((ObjMeta*)param)->objPtr();
+        if (!ptrs->destroyed) {
+          ptrs->destroyed = true;
+          // the locals unregistered by the destruction are dropped as well.
+          ptrs->resumed();
+          coroutine_handle<P>::from_address(ptrs->begin).destroy();
+          ptrs->suspended();
+        }
+        ptrs->~FramePtrs();
+      } break;
+      case ClassMeta::MemRequest::NewPtrEnumerator: {
+        return new FramePtrEnumerator((ObjMeta*)param);
+      } break;
+      case ClassMeta::MemRequest::TypeName:
+        return (void*)typeid(P).name();
+    }
+    return nullptr;
+  }
+
+  static ClassMeta inst;
+};
+
+template <typename P>
+ClassMeta CoroFrameClass<P>::inst{MemHandler, sizeof(CoroChunk)};
+
+// Wraps what a task awaits to keep runningFrame up to date as it suspends
+// and resumes.
+template <typename A>
+struct FrameAwaiter {
+  A inner;
+  FramePtrs* ptrs;
+
+  bool await_ready() { return inner.await_ready(); }
+  template <typename H>
+  auto await_suspend(H h) {
+    ptrs->suspended();
+    try {
+      return inner.await_suspend(h);
+    } catch (...) {
+      ptrs->resumed();
+      throw;
+    }
+  }
+  decltype(auto) await_resume() {
+    ptrs->resumed();
+    return inner.await_resume();
+  }
+};
+
+template <typename A, typename = void>
+struct HasCoAwait : false_type {};
+
+template <typename A>
+struct HasCoAwait<A, void_t<decltype(declval<A>().operator co_await())>>
+    : true_type {};
+
+// found by argument dependent lookup, as co_await does.
+template <typename A, typename = void>
+struct HasFreeCoAwait : false_type {};
+
+template <typename A>
+struct HasFreeCoAwait<A, void_t<decltype(operator co_await(declval<A>()))>>
+    : true_type {};
+
+template <typename P>
+struct TaskPromiseBase {
+  coroutine_handle<> continuation;
+  exception_ptr error;
+
+  static void* operator new(size_t sz) {
+    using C = CoroFrameClass<P>;
+    auto* cls = &C::inst;
+    auto cnt = (C::HeaderSize + sz + cls->size - 1) / cls->size;
+    assert(cnt <= (ObjMeta::LengthType)-1 && "coroutine frame too large");
+    auto* meta = cls->newMeta(cnt);
+    auto* ptrs = new (meta->objPtr()) FramePtrs();
+    ptrs->begin = meta->objPtr() + C::HeaderSize;
+    ptrs->end = ptrs->begin + sz;
+    cls->endNewMeta(meta, false);
+    // the parameters are copied into the frame now.
+    ptrs->resumed();
+    return ptrs->begin;
+  }
+  // Frames are freed by the collector, or here if the coroutine failed to
+  // start, e.g. a parameter threw while being copied.
+  static void operator delete(void* frame) {
+    auto* ptrs = CoroFrameClass<P>::ptrsOf(frame);
+    if (ptrs->destroyed)
+      return;
+    ptrs->destroyed = true;
+    ptrs->suspended();
+    auto* meta = CoroFrameClass<P>::metaOf(frame);
+    auto* c = Collector::get();
+#ifdef TGC_MULTI_THREADED
+    c->unpin(meta);
+#endif
+    c->releaseMeta(meta);
+  }
+
+  struct InitialAwaiter : suspend_always {
+    FramePtrs* ptrs;
+    void await_suspend(coroutine_handle<>) noexcept { ptrs->suspended(); }
+    void await_resume() noexcept { ptrs->resumed(); }
+  };
+
+  struct FinalAwaiter {
+    bool await_ready() noexcept { return false; }
+    coroutine_handle<> await_suspend(coroutine_handle<P> h) noexcept {
+      CoroFrameClass<P>::ptrsOf(h.address())->suspended();
+      auto c = h.promise().continuation;
+      return c ? c : noop_coroutine();
+    }
+    void await_resume() noexcept {}
+  };
+
+  InitialAwaiter initial_suspend() noexcept { return {{}, framePtrs()}; }
+  FinalAwaiter final_suspend() noexcept { return {}; }
+  void unhandled_exception() { error = current_exception(); }
+
+  template <typename A>
+  auto await_transform(A&& a) {
+    if constexpr (HasCoAwait<A>::value) {
+      using W = decltype(forward<A>(a).operator co_await());
+      return FrameAwaiter<W>{forward<A>(a).operator co_await(), framePtrs()};
+    } else if constexpr (HasFreeCoAwait<A>::value) {
+      using W = decltype(operator co_await(forward<A>(a)));
+      return FrameAwaiter<W>{operator co_await(forward<A>(a)), framePtrs()};
+    } else {
+      return FrameAwaiter<A>{forward<A>(a), framePtrs()};
+    }
+  }
+
+  // converted to gc_task by the compiler.
+  ObjMeta* get_return_object() { return CoroFrameClass<P>::metaOf(frame()); }
+
+ private:
+  void* frame() {
+    return coroutine_handle<P>::from_promise((P&)*this).address();
+  }
+  FramePtrs* framePtrs() { return CoroFrameClass<P>::ptrsOf(frame()); }
+};
+template <typename T>
+struct TaskPromise : TaskPromiseBase<TaskPromise<T>> {
+  optional<T> value;
+
+  template <typename U>
+  void return_value(U&& v) {
+    value.emplace(forward<U>(v));
+  }
+  T get() {
+    if (this->error)
+      rethrow_exception(this->error);
+    return move(*value);
+  }
+};
+
+template <>
+struct TaskPromise<void> : TaskPromiseBase<TaskPromise<void>> {
+  void return_void() {}
+  void get() {
+    if (error)
+      rethrow_exception(error);
+  }
+};
+
+// lazily started, run it by start() or co_await.
+template <typename T>
+class gc_task {
+ public:
+  using promise_type = TaskPromise<T>;
+
+  gc_task() {}
+  gc_task(ObjMeta* m) : frame(m) {}
+
+  explicit operator bool() const { return (bool)frame; }
+  bool done() const { return handle().done(); }
+  void start() { handle().resume(); }
+  // result of a finished task, the result is moved out.
+  T get() { return handle().promise().get(); }
+
+  bool await_ready() const { return done(); }
+  coroutine_handle<> await_suspend(coroutine_handle<> c) {
+    handle().promise().continuation = c;
+    return handle();
+  }
+  T await_resume() { return get(); }
+
+ private:
+  coroutine_handle<promise_type> handle() const {
+    return coroutine_handle<promise_type>::from_address(
+        (char*)frame.operator->() +
+        CoroFrameClass<promise_type>::HeaderSize);
+  }
+
+  gc<CoroChunk> frame;
+};
+
+#endif
+
+//////////////////////////////////////////////////////////////////////////
+/// Slot
+/// pointer stored in a gc container without registering to the collector,
+/// it is traced by the enumerator of the container instead. Slots can not be
+/// copied out of their container, convert them to gc<T> for that.
+
+template <typename T>
+class GcSlot {
+  template <typename U>
+  friend struct SlotAllocator;
+
+ public:
+  GcSlot() {}
+  GcSlot(const GcPtr<T>& r) { set(r.operator->(), r.getMeta()); }
+  GcSlot(const GcSlot&) = delete;
+
+  GcSlot& operator=(const GcPtr<T>& r) {
+    set(r.operator->(), r.getMeta());
+    return *this;
+  }
+  GcSlot& operator=(const GcSlot& r) {
+    set(r.p, r.meta);
+    return *this;
+  }
+  GcSlot& operator=(GcSlot&& r) {
+    set(r.p, r.meta);
+    r = nullptr;
+    return *this;
+  }
+  GcSlot& operator=(nullptr_t) {
+    p = nullptr;
+    meta = nullptr;
+    return *this;
+  }
+
+  operator gc<T>() const {
+    gc<T> r;
+    if (meta)
+      r.reset(p, meta);
+    return r;
+  }
+  T* operator->() const { return p; }
+  T& operator*() const { return *p; }
+  explicit operator bool() const { return p && meta; }
+  bool operator==(const GcSlot& r) const { return p == r.p; }
+  bool operator!=(const GcSlot& r) const { return p != r.p; }
+  ObjMeta* getMeta() const { return meta; }
+
+  // no write barrier, only valid between slots of the same container.
+  void swap(GcSlot& r) {
+    std::swap(p, r.p);
+    std::swap(meta, r.meta);
+  }
+
+ private:
+  // no write barrier, only for the slot containers relocating their elements.
+  GcSlot(GcSlot&& r) noexcept : p(r.p), meta(r.meta) { r = nullptr; }
+
+  void set(T* o, ObjMeta* m) {
+    p = o;
+    meta = m;
+    Collector::get()->onSlotChanged(m, o);
+  }
+
+ private:
+  T* p = nullptr;
+  ObjMeta* meta = nullptr;
+};
+
+template <typename T>
+void gc_delete(GcSlot<T>& s) {
+  if (s) {
+    s.getMeta()->destroy(s.operator->());
+    s = nullptr;
+  }
+}
+
+struct SlotPtrEnumerator : IPtrEnumerator {
+  const PtrBase* getNext() override { return nullptr; }
+  bool isSlotEnumerator() const override { return true; }
+};
+
+//////////////////////////////////////////////////////////////////////////
+// Wrap STL Containers
+//////////////////////////////////////////////////////////////////////////
+
+template <typename C>
+struct ContainerPtrEnumerator : IPtrEnumerator {
+  C* o;
+  typename C::iterator it;
+  ContainerPtrEnumerator(ObjMeta* m) : o((C*)m->objPtr()), it(o->begin()) {}
+  bool hasNext() override { return it != o->end(); }
+};
+
+// keys are enumerated as well when they are gc pointers.
+template <typename C>
+struct MapPtrEnumerator : ContainerPtrEnumerator<C> {
+  using ContainerPtrEnumerator<C>::ContainerPtrEnumerator;
+  bool keyVisited = false;
+
+  const PtrBase* getNext() override {
+    if constexpr (is_base_of<PtrBase, typename C::key_type>::value) {
+      if (!keyVisited) {
+        keyVisited = true;
+        return &this->it->first;
+      }
+      keyVisited = false;
+    }
+    auto* ret = &this->it->second;
+    ++this->it;
+    return ret;
+  }
+};
+
+// Clear a wrapped STL container. Its elements are unregistered in a batch
+// instead of one by one from their destructors, which also spares the
+// multi-threaded version a lock per element.
+template <typename C>
+void gc_clear(gc<C>& p) {
+  auto* meta = p.getMeta();
+  auto* it = meta->klass->enumPtrs(meta);
+  Collector::get()->unregisterPtrs(it);
+  delete it;
+  p->clear();
+}
+
+//////////////////////////////////////////////////////////////////////////
+/// Vector
+/// vector elements are not stored contiguously due to implementation
+/// limitation. use gc_new_array for better performance.
+
+template <typename T>
+class gc_vector : public gc<vector<gc<T>>> {
+ public:
+  using gc<vector<gc<T>>>::gc;
+  gc<T>& operator[](int idx) { return (**this)[idx]; }
+};
+
+template <typename T>
+struct PtrEnumerator<vector<gc<T>>> : ContainerPtrEnumerator<vector<gc<T>>> {
+  using ContainerPtrEnumerator<vector<gc<T>>>::ContainerPtrEnumerator;
+
+  const PtrBase* getNext() override { return &*this->it++; }
+};
 
 template <typename T, typename... Args>
 gc_vector<T> gc_new_vector(Args&&... args) {
@@ -532,9 +1830,9 @@ gc_vector<T> gc_new_vector(Args&&... args) {
 template <typename T>
 void gc_delete(gc_vector<T>& p) {
   for (auto& i : *p) {
-    gc_delete(i);
+    destroyElement(i);
   }
-  p->clear();
+  gc_clear(p);
 }
 
 //////////////////////////////////////////////////////////////////////////
@@ -544,7 +1842,7 @@ template <typename T>
 class gc_deque : public gc<deque<gc<T>>> {
  public:
   using gc<deque<gc<T>>>::gc;
-  gc<T>& operator[](int idx) { return (*this->p)[idx]; }
+  gc<T>& operator[](int idx) { return (**this)[idx]; }
 };
 
 template <typename T>
@@ -562,9 +1860,9 @@ gc_deque<T> gc_new_deque(Args&&... args) {
 template <typename T>
 void gc_delete(gc_deque<T>& p) {
   for (auto& i : *p) {
-    gc_delete(i);
+    destroyElement(i);
   }
-  p->clear();
+  gc_clear(p);
 }
 
 //////////////////////////////////////////////////////////////////////////
@@ -588,31 +1886,25 @@ gc_list<T> gc_new_list(Args&&... args) {
 template <typename T>
 void gc_delete(gc_list<T>& p) {
   for (auto& i : *p) {
-    gc_delete(i);
+    destroyElement(i);
   }
-  p->clear();
+  gc_clear(p);
 }
 
 //////////////////////////////////////////////////////////////////////////
 /// Map
-/// TODO: NOT support using gc object as key...
+/// gc objects used as keys are ordered by address.
 
 template <typename K, typename V>
 class gc_map : public gc<map<K, gc<V>>> {
  public:
   using gc<map<K, gc<V>>>::gc;
-  gc<V>& operator[](const K& k) { return (*this->p)[k]; }
+  gc<V>& operator[](const K& k) { return (**this)[k]; }
 };
 
 template <typename K, typename V>
-struct PtrEnumerator<map<K, gc<V>>> : ContainerPtrEnumerator<map<K, gc<V>>> {
-  using ContainerPtrEnumerator<map<K, gc<V>>>::ContainerPtrEnumerator;
-
-  const PtrBase* getNext() override {
-    auto* ret = &this->it->second;
-    ++this->it;
-    return ret;
-  }
+struct PtrEnumerator<map<K, gc<V>>> : MapPtrEnumerator<map<K, gc<V>>> {
+  using MapPtrEnumerator<map<K, gc<V>>>::MapPtrEnumerator;
 };
 
 template <typename K, typename V, typename... Args>
@@ -623,32 +1915,26 @@ gc_map<K, V> gc_new_map(Args&&... args) {
 template <typename K, typename V>
 void gc_delete(gc_map<K, V>& p) {
   for (auto& i : *p) {
-    gc_delete(i->value);
+    destroyElement(i.second);
   }
-  p->clear();
+  gc_clear(p);
 }
 
 //////////////////////////////////////////////////////////////////////////
 /// HashMap
-/// TODO: NOT support using gc object as key...
+/// gc objects used as keys are hashed by address.
 
 template <typename K, typename V>
 class gc_unordered_map : public gc<unordered_map<K, gc<V>>> {
  public:
   using gc<unordered_map<K, gc<V>>>::gc;
-  gc<V>& operator[](const K& k) { return (*this->p)[k]; }
+  gc<V>& operator[](const K& k) { return (**this)[k]; }
 };
 
 template <typename K, typename V>
 struct PtrEnumerator<unordered_map<K, gc<V>>>
-    : ContainerPtrEnumerator<unordered_map<K, gc<V>>> {
-  using ContainerPtrEnumerator<unordered_map<K, gc<V>>>::ContainerPtrEnumerator;
-
-  const PtrBase* getNext() override {
-    auto* ret = &this->it->second;
-    ++this->it;
-    return ret;
-  }
+    : MapPtrEnumerator<unordered_map<K, gc<V>>> {
+  using MapPtrEnumerator<unordered_map<K, gc<V>>>::MapPtrEnumerator;
 };
 
 template <typename K, typename V, typename... Args>
@@ -658,9 +1944,9 @@ gc_unordered_map<K, V> gc_new_unordered_map(Args&&... args) {
 template <typename K, typename V>
 void gc_delete(gc_unordered_map<K, V>& p) {
   for (auto& i : *p) {
-    gc_delete(i.second);
+    destroyElement(i.second);
   }
-  p->clear();
+  gc_clear(p);
 }
 
 //////////////////////////////////////////////////////////////////////////
@@ -683,8 +1969,756 @@ gc_set<V> gc_new_set(Args&&... args) {
 
 template <typename T>
 void gc_delete(gc_set<T>& p) {
+  for (auto& i : *p) {
+    destroyElement(i);
+  }
+  gc_clear(p);
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Flat Containers
+//////////////////////////////////////////////////////////////////////////
+
+//////////////////////////////////////////////////////////////////////////
+/// SlotVector & SlotDeque
+/// elements are slots, growing or shrinking relocates them without touching
+/// the pointer registry. Elements are traced by one enumerator of the
+/// container, convert them to gc<T> to keep them out of the container.
+
+template <typename C>
+struct SlotContainerPtrEnumerator : SlotPtrEnumerator {
+  C* o;
+  typename C::iterator it;
+  SlotContainerPtrEnumerator(ObjMeta* m)
+      : o((C*)m->objPtr()), it(o->begin()) {}
+  bool hasNext() override {
+    while (it != o->end() && !it->getMeta())
+      ++it;
+    return it != o->end();
+  }
+  ObjMeta* getNextMeta(const void*& obj) override {
+    obj = it->operator->();
+    return (it++)->getMeta();
+  }
+};
+
+// The allocator of the slot containers, the only one allowed to move
+// construct their slots.
+template <typename T>
+struct SlotAllocator : allocator<T> {
+  template <typename U>
+  struct rebind {
+    using other = SlotAllocator<U>;
+  };
+
+  SlotAllocator() = default;
+  template <typename U>
+  SlotAllocator(const SlotAllocator<U>&) {}
+
+  template <typename U, typename... Args>
+  void construct(U* p, Args&&... args) {
+    ::new ((void*)p) U(forward<Args>(args)...);
+  }
+};
+
+template <typename T>
+using SlotVector = vector<GcSlot<T>, SlotAllocator<GcSlot<T>>>;
+template <typename T>
+using SlotDeque = deque<GcSlot<T>, SlotAllocator<GcSlot<T>>>;
+
+template <typename T>
+class gc_slot_vector : public gc<SlotVector<T>> {
+ public:
+  using gc<SlotVector<T>>::gc;
+  GcSlot<T>& operator[](int idx) { return (**this)[idx]; }
+};
+
+template <typename T>
+struct PtrEnumerator<SlotVector<T>>
+    : SlotContainerPtrEnumerator<SlotVector<T>> {
+  using SlotContainerPtrEnumerator<
+      SlotVector<T>>::SlotContainerPtrEnumerator;
+};
+
+template <typename T, typename... Args>
+gc_slot_vector<T> gc_new_slot_vector(Args&&... args) {
+  return gc_new_meta<SlotVector<T>>(1, forward<Args>(args)...);
+}
+
+template <typename T>
+void gc_delete(gc_slot_vector<T>& p) {
+  for (auto& i : *p) {
+    destroyElement(i);
+  }
+  p->clear();
+}
+
+template <typename T>
+class gc_slot_deque : public gc<SlotDeque<T>> {
+ public:
+  using gc<SlotDeque<T>>::gc;
+  GcSlot<T>& operator[](int idx) { return (**this)[idx]; }
+};
+
+template <typename T>
+struct PtrEnumerator<SlotDeque<T>>
+    : SlotContainerPtrEnumerator<SlotDeque<T>> {
+  using SlotContainerPtrEnumerator<
+      SlotDeque<T>>::SlotContainerPtrEnumerator;
+};
+
+template <typename T, typename... Args>
+gc_slot_deque<T> gc_new_slot_deque(Args&&... args) {
+  return gc_new_meta<SlotDeque<T>>(1, forward<Args>(args)...);
+}
+
+template <typename T>
+void gc_delete(gc_slot_deque<T>& p) {
+  for (auto& i : *p) {
+    destroyElement(i);
+  }
+  p->clear();
+}
+
+//////////////////////////////////////////////////////////////////////////
+/// FlatHashMap
+/// open addressing with linear probing, values are slots in one entry array
+/// which is traced in a single pass. Keys must be default constructible and
+/// can not be gc pointers, use gc_unordered_map for them.
+
+template <typename K,
+          typename V,
+          typename Hash = hash<K>,
+          typename Eq = equal_to<K>>
+class FlatHashMap {
+  static_assert(!is_base_of<PtrBase, K>::value, "gc keys are not supported");
+
+ public:
+  struct Entry {
+    K first;
+    GcSlot<V> second;
+  };
+
+  class iterator {
+    FlatHashMap* m;
+    size_t i;
+
+    void skipEmpty() {
+      while (i < m->ctrl.size() && !m->ctrl[i])
+        i++;
+    }
+
+   public:
+    iterator(FlatHashMap* mm, size_t ii) : m(mm), i(ii) { skipEmpty(); }
+    Entry& operator*() const { return m->entries[i]; }
+    Entry* operator->() const { return &m->entries[i]; }
+    iterator& operator++() {
+      i++;
+      skipEmpty();
+      return *this;
+    }
+    bool operator==(const iterator& r) const { return i == r.i; }
+    bool operator!=(const iterator& r) const { return i != r.i; }
+  };
+
+  size_t size() const { return cnt; }
+  bool empty() const { return !cnt; }
+  iterator begin() { return {this, 0}; }
+  iterator end() { return {this, entries.size()}; }
+  iterator find(const K& k) {
+    auto i = lookup(k);
+    return {this, i == npos ? entries.size() : i};
+  }
+  size_t count(const K& k) const { return lookup(k) != npos; }
+
+  GcSlot<V>& operator[](const K& k) {
+    auto i = lookup(k);
+    if (i != npos)
+      return entries[i].second;
+
+    reserve(cnt + 1);
+    for (i = home(k); ctrl[i]; i = (i + 1) & mask())
+      ;
+    ctrl[i] = 1;
+    entries[i].first = k;
+    cnt++;
+    return entries[i].second;
+  }
+
+  // shift the following entries back instead of leaving tombstones.
+  size_t erase(const K& k) {
+    auto i = lookup(k);
+    if (i == npos)
+      return 0;
+
+    entries[i].second = nullptr;
+    for (auto j = (i + 1) & mask(); ctrl[j]; j = (j + 1) & mask()) {
+      auto h = home(entries[j].first);
+      // entry j can not move before its home slot.
+      if (i <= j ? (i < h && h <= j) : (i < h || h <= j))
+        continue;
+      swap(entries[i].first, entries[j].first);
+      entries[i].second.swap(entries[j].second);
+      i = j;
+    }
+    ctrl[i] = 0;
+    entries[i].first = K();
+    cnt--;
+    return 1;
+  }
+
+  void clear() {
+    for (size_t i = 0; i < ctrl.size(); i++) {
+      if (ctrl[i]) {
+        ctrl[i] = 0;
+        entries[i].first = K();
+        entries[i].second = nullptr;
+      }
+    }
+    cnt = 0;
+  }
+
+  // keep the load factor below 7/8.
+  void reserve(size_t n) {
+    auto cap = entries.size();
+    if (n * 8 <= cap * 7)
+      return;
+    auto bits = capBits ? capBits : 4;
+    while (n * 8 > ((size_t)1 << bits) * 7)
+      bits++;
+    rehash(bits);
+  }
+
+ private:
+  template <typename C>
+  friend struct PtrEnumerator;
+
+  static constexpr size_t npos = (size_t)-1;
+
+  size_t mask() const { return entries.size() - 1; }
+
+  // fibonacci hashing, spreads sequential keys hashed by identity.
+  size_t home(const K& k) const {
+    return (size_t)(((uint64_t)Hash()(k) * 11400714819323198485ull) >>
+                    (64 - capBits));
+  }
+
+  size_t lookup(const K& k) const {
+    if (!cnt)
+      return npos;
+    for (auto i = home(k); ctrl[i]; i = (i + 1) & mask()) {
+      if (Eq()(entries[i].first, k))
+        return i;
+    }
+    return npos;
+  }
+
+  void rehash(unsigned bits) {
+    auto oldEntries = move(entries);
+    auto oldCtrl = move(ctrl);
+    entries = vector<Entry>((size_t)1 << bits);
+    ctrl.assign((size_t)1 << bits, 0);
+    capBits = bits;
+
+    for (size_t i = 0; i < oldCtrl.size(); i++) {
+      if (!oldCtrl[i])
+        continue;
+      auto& e = oldEntries[i];
+      auto j = home(e.first);
+      for (; ctrl[j]; j = (j + 1) & mask())
+        ;
+      ctrl[j] = 1;
+      entries[j].first = move(e.first);
+      entries[j].second.swap(e.second);
+    }
+  }
+
+ private:
+  vector<Entry> entries;
+  vector<unsigned char> ctrl;
+  size_t cnt = 0;
+  unsigned capBits = 0;
+};
+
+template <typename K, typename V>
+class gc_flat_hash_map : public gc<FlatHashMap<K, V>> {
+ public:
+  using gc<FlatHashMap<K, V>>::gc;
+  GcSlot<V>& operator[](const K& k) { return (**this)[k]; }
+};
+
+template <typename K, typename V, typename H, typename E>
+struct PtrEnumerator<FlatHashMap<K, V, H, E>> : SlotPtrEnumerator {
+  using Entry = typename FlatHashMap<K, V, H, E>::Entry;
+  Entry *cur, *end;
+
+  PtrEnumerator(ObjMeta* m) {
+    auto* o = (FlatHashMap<K, V, H, E>*)m->objPtr();
+    cur = o->entries.data();
+    end = cur + o->entries.size();
+  }
+  bool hasNext() override {
+    while (cur != end && !cur->second.getMeta())
+      cur++;
+    return cur != end;
+  }
+  ObjMeta* getNextMeta(const void*& obj) override {
+    obj = cur->second.operator->();
+    return (cur++)->second.getMeta();
+  }
+};
+
+template <typename K, typename V, typename... Args>
+gc_flat_hash_map<K, V> gc_new_flat_hash_map(Args&&... args) {
+  return gc_new_meta<FlatHashMap<K, V>>(1, forward<Args>(args)...);
+}
+
+template <typename K, typename V>
+void gc_delete(gc_flat_hash_map<K, V>& p) {
+  for (auto& i : *p) {
+    destroyElement(i.second);
+  }
+  p->clear();
+}
+
+//////////////////////////////////////////////////////////////////////////
+/// BTreeMap
+/// ordered map with nodes allocated from the gc heap, values are slots in the
+/// node arrays so inserts don't register pointers and each node is traced in
+/// one pass. Inserting or erasing invalidates iterators and references to
+/// values. Keys must be default constructible and can not be gc pointers, use
+/// gc_map for them.
+
+template <typename K, typename V>
+struct BTreeLeaf {
+  static constexpr int Degree = 16;
+  static constexpr int MaxKeys = Degree * 2 - 1;
+
+  unsigned short cnt = 0;
+  bool leaf = true;
+  K keys[MaxKeys];
+  GcSlot<V> vals[MaxKeys];
+};
+
+template <typename K, typename V>
+struct BTreeInner : BTreeLeaf<K, V> {
+  GcSlot<BTreeLeaf<K, V>> childs[BTreeLeaf<K, V>::MaxKeys + 1];
+
+  BTreeInner() { this->leaf = false; }
+};
+
+template <typename K, typename V, typename Less = less<K>>
+class BTreeMap {
+  static_assert(!is_base_of<PtrBase, K>::value, "gc keys are not supported");
+  static_assert(sizeof(BTreeInner<K, V>) <= (ClassMeta::SizeType)-1,
+                "keys too large for a node");
+
+  using Leaf = BTreeLeaf<K, V>;
+  using Inner = BTreeInner<K, V>;
+  static constexpr int Degree = Leaf::Degree;
+  static constexpr int MaxDepth = 16;
+
+ public:
+  struct Ref {
+    const K& first;
+    GcSlot<V>& second;
+    const Ref* operator->() const { return this; }
+  };
+
+  class iterator {
+    friend class BTreeMap;
+
+    struct Pos {
+      Leaf* n;
+      int i;
+    };
+    Pos path[MaxDepth];
+    int depth = 0;
+
+    Pos& top() { return path[depth - 1]; }
+    void push(Leaf* n, int i) {
+      assert(depth < MaxDepth);
+      path[depth++] = {n, i};
+    }
+    void pushLeftmost(Leaf* n) {
+      for (push(n, 0); !n->leaf; push(n, 0))
+        n = childAt(n, 0);
+    }
+    // finished nodes are popped, the next key is in an ancestor.
+    void skipFinished() {
+      while (depth && top().i >= top().n->cnt)
+        depth--;
+    }
+
+   public:
+    Ref operator*() const {
+      auto& p = path[depth - 1];
+      return {p.n->keys[p.i], p.n->vals[p.i]};
+    }
+    Ref operator->() const { return **this; }
+    iterator& operator++() {
+      auto& p = top();
+      p.i++;
+      if (p.n->leaf)
+        skipFinished();
+      else
+        pushLeftmost(childAt(p.n, p.i));
+      return *this;
+    }
+    bool operator==(const iterator& r) const {
+      if (depth != r.depth)
+        return false;
+      return !depth || (path[depth - 1].n == r.path[depth - 1].n &&
+                        path[depth - 1].i == r.path[depth - 1].i);
+    }
+    bool operator!=(const iterator& r) const { return !(*this == r); }
+  };
+
+  size_t size() const { return cnt; }
+  bool empty() const { return !cnt; }
+  iterator begin() {
+    iterator it;
+    if (root)
+      it.pushLeftmost(rootNode());
+    return it;
+  }
+  iterator end() { return {}; }
+  iterator lower_bound(const K& k) { return bound(k, false); }
+  iterator upper_bound(const K& k) { return bound(k, true); }
+  iterator find(const K& k) {
+    auto it = lower_bound(k);
+    return it != end() && !Less()(k, it->first) ? it : end();
+  }
+  size_t count(const K& k) { return find(k) != end(); }
+  void clear() {
+    root = nullptr;
+    cnt = 0;
+  }
+
+  GcSlot<V>& operator[](const K& k) {
+    if (!root)
+      root = newNode(true);
+    if (rootNode()->cnt == Leaf::MaxKeys) {
+      auto r = newNode(false);
+      inner(r.operator->())->childs[0] = move(root);
+      root = r;
+      splitChild(inner(rootNode()), 0);
+    }
+
+    for (auto* n = rootNode();;) {
+      int i = lowerIdx(n, k);
+      if (i < n->cnt && !Less()(k, n->keys[i]))
+        return n->vals[i];
+      if (n->leaf) {
+        for (int j = n->cnt; j > i; j--) {
+          n->keys[j] = move(n->keys[j - 1]);
+          n->vals[j].swap(n->vals[j - 1]);
+        }
+        n->keys[i] = k;
+        n->cnt++;
+        cnt++;
+        return n->vals[i];
+      }
+      if (childAt(n, i)->cnt == Leaf::MaxKeys) {
+        splitChild(inner(n), i);
+        if (!Less()(k, n->keys[i])) {
+          if (!Less()(n->keys[i], k))
+            return n->vals[i];
+          i++;
+        }
+      }
+      n = childAt(n, i);
+    }
+  }
+
+  size_t erase(const K& k) {
+    if (!root || !eraseFrom(rootNode(), k))
+      return 0;
+    cnt--;
+    auto* r = rootNode();
+    if (!r->cnt) {
+      if (r->leaf)
+        root = nullptr;
+      else
+        root = move(inner(r)->childs[0]);
+    }
+    return 1;
+  }
+
+ private:
+  template <typename C>
+  friend struct PtrEnumerator;
+
+  Leaf* rootNode() const { return root.operator->(); }
+  static Inner* inner(Leaf* n) { return static_cast<Inner*>(n); }
+  static Leaf* childAt(Leaf* n, int i) {
+    return inner(n)->childs[i].operator->();
+  }
+  static gc<Leaf> newNode(bool leaf) {
+    return leaf ? gc<Leaf>(gc_new_meta<Leaf>(1))
+                : gc<Leaf>(gc_new_meta<Inner>(1));
+  }
+  static int lowerIdx(Leaf* n, const K& k) {
+    return int(std::lower_bound(n->keys, n->keys + n->cnt, k, Less()) -
+               n->keys);
+  }
+  static int upperIdx(Leaf* n, const K& k) {
+    return int(std::upper_bound(n->keys, n->keys + n->cnt, k, Less()) -
+               n->keys);
+  }
+
+  iterator bound(const K& k, bool upper) {
+    iterator it;
+    for (auto* n = rootNode(); n; n = childAt(n, it.top().i)) {
+      it.push(n, upper ? upperIdx(n, k) : lowerIdx(n, k));
+      if (n->leaf)
+        break;
+    }
+    it.skipFinished();
+    return it;
+  }
+
+  // Values moved between nodes go through the slot barrier, shifting inside
+  // one node or into a new node linked afterwards swaps them.
+
+  // the full child i is split around its middle key, which moves up to x.
+  void splitChild(Inner* x, int i) {
+    auto* y = childAt(x, i);
+    auto z = newNode(y->leaf);
+    auto* zn = z.operator->();
+    for (int j = 0; j < Degree - 1; j++) {
+      zn->keys[j] = move(y->keys[j + Degree]);
+      zn->vals[j].swap(y->vals[j + Degree]);
+      y->keys[j + Degree] = K();
+    }
+    if (!y->leaf) {
+      for (int j = 0; j < Degree; j++)
+        inner(zn)->childs[j].swap(inner(y)->childs[j + Degree]);
+    }
+    zn->cnt = Degree - 1;
+
+    for (int j = x->cnt; j > i; j--) {
+      x->keys[j] = move(x->keys[j - 1]);
+      x->vals[j].swap(x->vals[j - 1]);
+      x->childs[j + 1].swap(x->childs[j]);
+    }
+    x->childs[i + 1] = z;
+    x->keys[i] = move(y->keys[Degree - 1]);
+    x->vals[i] = move(y->vals[Degree - 1]);
+    y->keys[Degree - 1] = K();
+    y->cnt = Degree - 1;
+    x->cnt++;
+  }
+
+  void removeAt(Leaf* n, int i) {
+    for (int j = i; j < n->cnt - 1; j++) {
+      n->keys[j] = move(n->keys[j + 1]);
+      n->vals[j].swap(n->vals[j + 1]);
+    }
+    n->cnt--;
+    n->keys[n->cnt] = K();
+    n->vals[n->cnt] = nullptr;
+  }
+
+  // child i + 1 and key i of x are appended to child i.
+  void merge(Inner* x, int i) {
+    auto* y = childAt(x, i);
+    auto* z = childAt(x, i + 1);
+    int base = y->cnt;
+    y->keys[base] = move(x->keys[i]);
+    y->vals[base] = move(x->vals[i]);
+    for (int j = 0; j < z->cnt; j++) {
+      y->keys[base + 1 + j] = move(z->keys[j]);
+      y->vals[base + 1 + j] = move(z->vals[j]);
+    }
+    if (!y->leaf) {
+      for (int j = 0; j <= z->cnt; j++)
+        inner(y)->childs[base + 1 + j] = move(inner(z)->childs[j]);
+    }
+    y->cnt += z->cnt + 1;
+
+    for (int j = i; j < x->cnt - 1; j++) {
+      x->keys[j] = move(x->keys[j + 1]);
+      x->vals[j].swap(x->vals[j + 1]);
+      x->childs[j + 1].swap(x->childs[j + 2]);
+    }
+    x->cnt--;
+    x->keys[x->cnt] = K();
+    x->childs[x->cnt + 1] = nullptr;
+  }
+
+  void borrowFromPrev(Inner* x, int i) {
+    auto* c = childAt(x, i);
+    auto* s = childAt(x, i - 1);
+    for (int j = c->cnt; j > 0; j--) {
+      c->keys[j] = move(c->keys[j - 1]);
+      c->vals[j].swap(c->vals[j - 1]);
+    }
+    if (!c->leaf) {
+      for (int j = c->cnt + 1; j > 0; j--)
+        inner(c)->childs[j].swap(inner(c)->childs[j - 1]);
+      inner(c)->childs[0] = move(inner(s)->childs[s->cnt]);
+    }
+    c->keys[0] = move(x->keys[i - 1]);
+    c->vals[0] = move(x->vals[i - 1]);
+    c->cnt++;
+
+    s->cnt--;
+    x->keys[i - 1] = move(s->keys[s->cnt]);
+    x->vals[i - 1] = move(s->vals[s->cnt]);
+    s->keys[s->cnt] = K();
+  }
+
+  void borrowFromNext(Inner* x, int i) {
+    auto* c = childAt(x, i);
+    auto* s = childAt(x, i + 1);
+    c->keys[c->cnt] = move(x->keys[i]);
+    c->vals[c->cnt] = move(x->vals[i]);
+    if (!c->leaf)
+      inner(c)->childs[c->cnt + 1] = move(inner(s)->childs[0]);
+    c->cnt++;
+
+    x->keys[i] = move(s->keys[0]);
+    x->vals[i] = move(s->vals[0]);
+    for (int j = 0; j < s->cnt - 1; j++) {
+      s->keys[j] = move(s->keys[j + 1]);
+      s->vals[j].swap(s->vals[j + 1]);
+    }
+    if (!s->leaf) {
+      for (int j = 0; j < s->cnt; j++)
+        inner(s)->childs[j].swap(inner(s)->childs[j + 1]);
+    }
+    s->cnt--;
+    s->keys[s->cnt] = K();
+  }
+
+  // every node descended into keeps at least Degree keys, so erasing from it
+  // never underflows.
+  bool eraseFrom(Leaf* x, const K& k) {
+    int i = lowerIdx(x, k);
+    bool found = i < x->cnt && !Less()(k, x->keys[i]);
+    if (x->leaf) {
+      if (found)
+        removeAt(x, i);
+      return found;
+    }
+
+    if (found) {
+      auto* y = childAt(x, i);
+      auto* z = childAt(x, i + 1);
+      if (y->cnt >= Degree) {
+        // replaced by the predecessor, which is then erased from the left.
+        auto* p = y;
+        while (!p->leaf)
+          p = childAt(p, p->cnt);
+        x->keys[i] = p->keys[p->cnt - 1];
+        x->vals[i] = move(p->vals[p->cnt - 1]);
+        return eraseFrom(y, K(x->keys[i]));
+      }
+      if (z->cnt >= Degree) {
+        auto* p = z;
+        while (!p->leaf)
+          p = childAt(p, 0);
+        x->keys[i] = p->keys[0];
+        x->vals[i] = move(p->vals[0]);
+        return eraseFrom(z, K(x->keys[i]));
+      }
+      merge(inner(x), i);
+      return eraseFrom(y, k);
+    }
+
+    if (childAt(x, i)->cnt < Degree) {
+      if (i > 0 && childAt(x, i - 1)->cnt >= Degree) {
+        borrowFromPrev(inner(x), i);
+      } else if (i < x->cnt && childAt(x, i + 1)->cnt >= Degree) {
+        borrowFromNext(inner(x), i);
+      } else {
+        if (i == x->cnt)
+          i--;
+        merge(inner(x), i);
+      }
+    }
+    return eraseFrom(childAt(x, i), k);
+  }
+
+ private:
+  GcSlot<Leaf> root;
+  size_t cnt = 0;
+};
+
+template <typename K, typename V>
+class gc_btree_map : public gc<BTreeMap<K, V>> {
+ public:
+  using gc<BTreeMap<K, V>>::gc;
+  GcSlot<V>& operator[](const K& k) { return (**this)[k]; }
+};
+
+template <typename K, typename V, typename L>
+struct PtrEnumerator<BTreeMap<K, V, L>> : SlotPtrEnumerator {
+  BTreeMap<K, V, L>* o;
+  bool visited = false;
+
+  PtrEnumerator(ObjMeta* m) : o((BTreeMap<K, V, L>*)m->objPtr()) {}
+  bool hasNext() override { return !visited && o->root.getMeta(); }
+  ObjMeta* getNextMeta(const void*& obj) override {
+    visited = true;
+    obj = o->root.operator->();
+    return o->root.getMeta();
+  }
+};
+
+template <typename K, typename V>
+struct PtrEnumerator<BTreeLeaf<K, V>> : SlotPtrEnumerator {
+  BTreeLeaf<K, V>* n;
+  int i = 0;
+
+  PtrEnumerator(ObjMeta* m) : n((BTreeLeaf<K, V>*)m->objPtr()) {}
+  bool hasNext() override {
+    while (i < n->cnt && !n->vals[i].getMeta())
+      i++;
+    return i < n->cnt;
+  }
+  ObjMeta* getNextMeta(const void*& obj) override {
+    obj = n->vals[i].operator->();
+    return n->vals[i++].getMeta();
+  }
+};
+
+// values first, then children.
+template <typename K, typename V>
+struct PtrEnumerator<BTreeInner<K, V>> : SlotPtrEnumerator {
+  BTreeInner<K, V>* n;
+  int i = 0;
+
+  PtrEnumerator(ObjMeta* m) : n((BTreeInner<K, V>*)m->objPtr()) {}
+  ObjMeta* slotMeta(int idx) const {
+    return idx < n->cnt ? n->vals[idx].getMeta()
+                        : n->childs[idx - n->cnt].getMeta();
+  }
+  const void* slotObj(int idx) const {
+    return idx < n->cnt ? (const void*)n->vals[idx].operator->()
+                        : (const void*)n->childs[idx - n->cnt].operator->();
+  }
+  bool hasNext() override {
+    while (i <= n->cnt * 2 && !slotMeta(i))
+      i++;
+    return i <= n->cnt * 2;
+  }
+  ObjMeta* getNextMeta(const void*& obj) override {
+    obj = slotObj(i);
+    return slotMeta(i++);
+  }
+};
+
+template <typename K, typename V, typename... Args>
+gc_btree_map<K, V> gc_new_btree_map(Args&&... args) {
+  return gc_new_meta<BTreeMap<K, V>>(1, forward<Args>(args)...);
+}
+
+template <typename K, typename V>
+void gc_delete(gc_btree_map<K, V>& p) {
   for (auto i : *p) {
-    gc_delete(i);
+    destroyElement(i.second);
   }
   p->clear();
 }
@@ -695,11 +2729,54 @@ void gc_delete(gc_set<T>& p) {
 // Public APIs
 
 using details::gc;
+using details::gc_clear;
 using details::gc_collect;
+using details::gc_collect_auto;
+using details::gc_collect_full;
+using details::gc_prepare_fork;
+using details::gc_make_permanent;
+using details::gc_permanent_scope;
+using details::gc_pacer_stats;
+using details::GcPacerStats;
 using details::gc_dumpStats;
+using details::gc_idle_notification;
+using details::gc_stats;
+using details::GcStats;
+using details::gc_add_event_listener;
+using details::gc_remove_event_listener;
+using details::gc_set_heap_thresholds;
+using details::GcEvent;
+using details::GcEventInfo;
+using details::GcEventListener;
+using details::GcState;
+#ifdef TGC_COUNTERS
+using details::gc_counters;
+using details::gc_reset_counters;
+using details::GcCounters;
+#endif
+#ifdef TGC_AGE_STATS
+using details::gc_age_stats;
+using details::GcAgeHistogram;
+#endif
+#ifdef TGC_HEAP_PROFILER
+using details::gc_heap_profiler_dump;
+using details::gc_heap_profiler_start;
+using details::gc_heap_profiler_stop;
+#endif
+#ifdef TGC_MULTI_THREADED
+using details::gc_set_mark_threads;
+#endif
+#if defined(TGC_MULTI_THREADED) && defined(TGC_LOCK_STATS)
+using details::gc_class_lock_stats;
+using details::gc_collector_lock_stats;
+using details::LockStats;
+#endif
 using details::gc_dynamic_pointer_cast;
 using details::gc_from;
 using details::gc_function;
+#ifdef __cpp_impl_coroutine
+using details::gc_task;
+#endif
 using details::gc_new;
 using details::gc_new_array;
 using details::gc_static_pointer_cast;
@@ -722,6 +2799,18 @@ using details::gc_set;
 using details::gc_new_unordered_map;
 using details::gc_unordered_map;
 
+using details::gc_new_slot_vector;
+using details::gc_slot_vector;
+
+using details::gc_new_slot_deque;
+using details::gc_slot_deque;
+
+using details::gc_flat_hash_map;
+using details::gc_new_flat_hash_map;
+
+using details::gc_btree_map;
+using details::gc_new_btree_map;
+
 TGC_DECL_AUTO_BOX(char, gc_char);
 TGC_DECL_AUTO_BOX(unsigned char, gc_uchar);
 TGC_DECL_AUTO_BOX(short, gc_short);
@@ -735,3 +2824,15 @@ TGC_DECL_AUTO_BOX(unsigned long, gc_ulong);
 TGC_DECL_AUTO_BOX(std::string, gc_string);
 
 }  // namespace tgc
+
+namespace std {
+
+// hash gc pointers by identity, e.g. for keys of gc_unordered_map.
+template <typename T>
+struct hash<tgc::details::gc<T>> {
+  size_t operator()(const tgc::details::gc<T>& p) const {
+    return hash<T*>()(p.operator->());
+  }
+};
+
+}  // namespace std